@@ -4,8 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "audio.h"
 #include "minigbs.h"
+#include "vgm.h"
+#include "util.h"
 
 #define ENABLE_HIPASS 1
 
@@ -14,81 +20,17 @@
 #define SCREEN_REFRESH_CYCLES 70224.0
 #define VERTICAL_SYNC (DMG_CLOCK_FREQ / SCREEN_REFRESH_CYCLES)
 
-#define AUDIO_MEM_SIZE (0xFF3F - 0xFF06 + 1)
 #define AUDIO_ADDR_COMPENSATION 0xFF06
 
-#define MAX(a, b) ({ a > b ? a : b; })
-#define MIN(a, b) ({ a <= b ? a : b; })
+/* Anything quieter than this is below the LSB of 16-bit output. */
+#define SILENCE_THRESHOLD (1.0f / 32768.0f)
 
-/**
- * Memory holding audio registers between 0xFF06 and 0xFF3F inclusive.
- */
-static uint8_t audio_mem[AUDIO_MEM_SIZE];
-
-struct chan_len_ctr {
-	int   load;
-	bool  enabled;
-	float counter;
-	float inc;
-};
-
-struct chan_vol_env {
-	int   step;
-	bool  up;
-	float counter;
-	float inc;
-};
-
-struct chan_freq_sweep {
-	int   freq;
-	int   rate;
-	bool  up;
-	int   shift;
-	float counter;
-	float inc;
-};
-
-static struct chan {
-	unsigned int enabled : 1;
-	unsigned int powered : 1;
-	unsigned int on_left : 1;
-	unsigned int on_right : 1;
-	unsigned int muted : 1;
-
-	unsigned int volume : 4;
-	unsigned int volume_init : 4;
-
-	uint16_t freq;
-	float    freq_counter;
-	float    freq_inc;
-
-	int val;
-	int note;
-
-	struct chan_len_ctr    len;
-	struct chan_vol_env    env;
-	struct chan_freq_sweep sweep;
-
-	float capacitor;
-
-	// square
-	uint8_t duty;
-	uint8_t duty_counter;
-
-	// noise
-	uint16_t lfsr_reg;
-	bool     lfsr_wide;
-	int      lfsr_div;
-
-	// wave
-	uint8_t sample;
-} chans[4];
-
-static unsigned int nsamples;
-static float *      samples;
-static float *      sample_ptr;
-
-static float vol_l, vol_r;
+/* Channel phase is fixed point, so that it advances by exactly the same amount
+ * however frames are grouped. */
+#define PHASE_ONE (1ULL << 32)
+
+/* Steps before the whole 16-bit LFSR register is inside its cycle. */
+#define LFSR_WARMUP 17
 
 static float hipass(struct chan *c, float sample)
 {
@@ -101,28 +43,46 @@ static float hipass(struct chan *c, float sample)
 #endif
 }
 
+/**
+ * Mix "sample" of channel "c" into the output at sample index "i".
+ */
+static void mix_sample(struct audio *a, struct chan *c, const unsigned int i,
+		       const float sample)
+{
+	a->samples[i + 0] += sample * 0.25f * c->on_left * a->vol_l;
+	a->samples[i + 1] += sample * 0.25f * c->on_right * a->vol_r;
+
+	if (a->stems_enabled) {
+		float *stem = a->stem_samples[c - a->chans];
+
+		stem[i + 0] = sample * c->on_left;
+		stem[i + 1] = sample * c->on_right;
+	}
+}
+
 static void set_note_freq(struct chan *c, const float freq)
 {
 	c->freq_inc = freq / AUDIO_SAMPLE_RATE;
 	c->note     = fmaxf(0.0f, roundf(logf(freq / 440.0f)) + 48.0f);
 }
 
-static void chan_enable(const unsigned int i, const bool enable)
+static void chan_enable(struct audio *a, const unsigned int i,
+			const bool enable)
 {
-	chans[i].enabled = enable;
+	a->chans[i].enabled = enable;
 
-	uint8_t val = (audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x80) |
-		      (chans[3].enabled << 3) | (chans[2].enabled << 2) |
-		      (chans[1].enabled << 1) | (chans[0].enabled << 0);
+	uint8_t val = (a->mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x80) |
+		      (a->chans[3].enabled << 3) | (a->chans[2].enabled << 2) |
+		      (a->chans[1].enabled << 1) | (a->chans[0].enabled << 0);
 
-	audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
+	a->mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
 }
 
-static void update_env(struct chan *c)
+static void update_env(struct chan *c, const unsigned int n)
 {
-	c->env.counter += c->env.inc;
+	c->env.counter += c->env.inc * n;
 
-	while (c->env.counter > 1.0f) {
+	while (c->env.counter > 1.0f && c->env.inc != 0) {
 		if (c->env.step) {
 			c->volume += c->env.up ? 1 : -1;
 			if (c->volume == 0 || c->volume == 15) {
@@ -134,35 +94,50 @@ static void update_env(struct chan *c)
 	}
 }
 
-static void update_len(struct chan *c)
+static void update_len(struct audio *a, struct chan *c, const unsigned int n)
 {
 	if (c->len.enabled) {
-		c->len.counter += c->len.inc;
+		c->len.counter += c->len.inc * n;
 		if (c->len.counter > 1.0f) {
-			chan_enable(c - chans, 0);
+			chan_enable(a, c - a->chans, 0);
 			c->len.counter = 0.0f;
 		}
 	}
 }
 
-static bool update_freq(struct chan *c, float *pos)
+/**
+ * Phase advance of channel "c" per frame, in fixed point with PHASE_ONE per
+ * waveform step.
+ */
+static uint64_t phase_inc(const struct chan *c)
 {
-	float inc = c->freq_inc - *pos;
-	c->freq_counter += inc;
+	return c->freq_inc * (float)PHASE_ONE;
+}
 
-	if (c->freq_counter > 1.0f) {
-		*pos		= c->freq_inc - (c->freq_counter - 1.0f);
-		c->freq_counter = 0.0f;
+/**
+ * Advance the phase of channel "c" from "*pos" within a frame whose phase
+ * advance is "inc" up to the next waveform step, if it falls within the frame.
+ * \return	true with "*pos" at the step, or false with "*pos" at the end of
+ *		the frame.
+ */
+static bool update_freq(struct chan *c, uint64_t *pos, const uint64_t inc)
+{
+	const uint64_t total = c->freq_counter + (inc - *pos);
+
+	if (total >= PHASE_ONE) {
+		*pos += PHASE_ONE - c->freq_counter;
+		c->freq_counter = 0;
 		return true;
-	} else {
-		*pos = c->freq_inc;
-		return false;
 	}
+
+	c->freq_counter = total;
+	*pos		= inc;
+	return false;
 }
 
-static void update_sweep(struct chan *c)
+static void update_sweep(struct chan *c, const unsigned int n)
 {
-	c->sweep.counter += c->sweep.inc;
+	c->sweep.counter += c->sweep.inc * n;
 
 	while (c->sweep.counter > 1.0f) {
 		if (c->sweep.shift) {
@@ -186,54 +161,176 @@ static void update_sweep(struct chan *c)
 	}
 }
 
-static void update_square(const bool ch2)
+static void lfsr_step(struct chan *c)
+{
+	c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+
+	if (c->lfsr_wide) {
+		c->val = !(((c->lfsr_reg >> 14) & 1) ^
+			   ((c->lfsr_reg >> 13) & 1)) ?
+				 1 :
+				 -1;
+	} else {
+		c->val = !(((c->lfsr_reg >> 6) & 1) ^
+			   ((c->lfsr_reg >> 5) & 1)) ?
+				 1 :
+				 -1;
+	}
+}
+
+/**
+ * Whether channel "c" would contribute nothing audible to the next block if it
+ * were not muted.
+ */
+static bool chan_silent(const struct audio *a, const struct chan *c)
+{
+	if (!c->powered || !c->enabled)
+		return true;
+
+	/* Wave volume is a fixed shift, where 0 mutes the channel. */
+	if (c == a->chans + 2)
+		return c->volume == 0;
+
+	/* The envelope may raise the volume again within this block. */
+	if (c->volume != 0 || (c->env.step != 0 && c->env.inc != 0))
+		return false;
+
+	/* Let the high-pass filter settle before skipping its output. */
+	return fabsf(c->capacitor) < SILENCE_THRESHOLD;
+}
+
+/**
+ * Advance the timers, phase and LFSR of channel "c" by "n" samples without
+ * rendering them. The length, envelope and sweep timers are float counters,
+ * and adding "n" increments at once rounds differently from adding them one
+ * at a time, so they are deliberately stepped frame by frame in the same order
+ * as synthesis rather than in closed form: the channel then ends up in exactly
+ * the state rendering would leave it in. The phase is summed in fixed point,
+ * and the waveform and LFSR are advanced in one go. Unpowered channels stand
+ * still, as does a disabled channel, whose length counter is reloaded before
+ * it can play again.
+ */
+static void chan_fast_forward(struct audio *a, struct chan *c,
+			      const unsigned int n)
 {
-	struct chan *c = chans + ch2;
-	if (!c->powered)
+	const unsigned int ch	 = c - a->chans;
+	unsigned int	   steps = 0;
+	unsigned int	   live	 = 0;
+
+	if (!c->powered || !c->enabled)
 		return;
 
+	for (unsigned int i = 0; i < n; ++i) {
+		uint64_t total;
+
+		update_len(a, c, 1);
+		if (!c->enabled)
+			continue;
+
+		if (ch != 2)
+			update_env(c, 1);
+		if (ch == 0)
+			update_sweep(c, 1);
+
+		total		= c->freq_counter + phase_inc(c);
+		steps		+= total / PHASE_ONE;
+		c->freq_counter = total % PHASE_ONE;
+		live++;
+	}
+
+	if (live > 0) {
+		switch (ch) {
+		case 0:
+		case 1:
+			if (steps) {
+				c->duty_counter = (c->duty_counter + steps) & 7;
+				c->val = (c->duty & (1 << c->duty_counter)) ?
+						 1 :
+						 -1;
+			}
+			break;
+
+		case 2:
+			c->val = (c->val + steps) & 31;
+			break;
+
+		case 3: {
+			/* The LFSR repeats with a period of 2^n - 1. */
+			const unsigned int period = c->lfsr_wide ? 32767 : 127;
+
+			if (steps > LFSR_WARMUP + period)
+				steps = LFSR_WARMUP +
+					(steps - LFSR_WARMUP) % period;
+
+			while (steps--)
+				lfsr_step(c);
+		} break;
+		}
+
+		/* Closed form of hipass() for a zero input. */
+		if (c->powered && (ch != 2 || c->volume))
+			c->capacitor *= powf(0.996f, live);
+	}
+}
+
+/**
+ * Channels are only synthesised when audible and not muted, and return whether
+ * they were audible, so that muting a channel does not make it count as
+ * silence.
+ */
+static bool update_square(struct audio *a, const bool ch2, const bool muted)
+{
+	struct chan *c = a->chans + ch2;
+
 	set_note_freq(c, 4194304.0f / (float)((2048 - c->freq) << 5));
 	c->freq_inc *= 8.0f;
 
-	for (unsigned int i = 0; i < nsamples; i += 2) {
-		update_len(c);
+	const bool audible = !chan_silent(a, c);
+
+	if (!audible || muted) {
+		chan_fast_forward(a, c, a->nsamples / 2);
+		return audible;
+	}
+
+	for (unsigned int i = 0; i < a->nsamples; i += 2) {
+		update_len(a, c, 1);
 
 		if (c->enabled) {
-			update_env(c);
+			update_env(c, 1);
 			if (!ch2)
-				update_sweep(c);
+				update_sweep(c, 1);
 
-			float pos      = 0.0f;
-			float prev_pos = 0.0f;
-			float sample   = 0.0f;
+			const uint64_t inc	= phase_inc(c);
+			const float    per_inc	= 1.0f / inc;
+			uint64_t       pos	= 0;
+			uint64_t       prev_pos = 0;
+			float	       sample	= 0.0f;
 
-			while (update_freq(c, &pos)) {
+			while (update_freq(c, &pos, inc)) {
 				c->duty_counter = (c->duty_counter + 1) & 7;
-				sample += ((pos - prev_pos) / c->freq_inc) *
+				sample += ((pos - prev_pos) * per_inc) *
 					  (float)c->val;
 				c->val = (c->duty & (1 << c->duty_counter)) ?
 						 1 :
 						 -1;
 				prev_pos = pos;
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) *
+			sample += ((pos - prev_pos) * per_inc) *
 				  (float)c->val;
 			sample = hipass(c, sample * (c->volume / 15.0f));
 
-			if (!c->muted) {
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * vol_l;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * vol_r;
-			}
+			mix_sample(a, c, i, sample);
 		}
 	}
+
+	return true;
 }
 
-static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
+static uint8_t wave_sample(const struct audio *a, const unsigned int pos,
+			   const unsigned int volume)
 {
 	uint8_t sample =
-		audio_mem[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
+		a->mem[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
 	if (pos & 1) {
 		sample &= 0xF;
 	} else {
@@ -242,35 +339,42 @@ static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(void)
+static bool update_wave(struct audio *a, const bool muted)
 {
-	struct chan *c = chans + 2;
-	if (!c->powered)
-		return;
+	struct chan *c = a->chans + 2;
 
 	float freq = 4194304.0f / (float)((2048 - c->freq) << 5);
 	set_note_freq(c, freq);
 
 	c->freq_inc *= 16.0f;
 
-	for (unsigned int i = 0; i < nsamples; i += 2) {
-		update_len(c);
+	const bool audible = !chan_silent(a, c);
+
+	if (!audible || muted) {
+		chan_fast_forward(a, c, a->nsamples / 2);
+		return audible;
+	}
+
+	for (unsigned int i = 0; i < a->nsamples; i += 2) {
+		update_len(a, c, 1);
 
 		if (c->enabled) {
-			float pos      = 0.0f;
-			float prev_pos = 0.0f;
-			float sample   = 0.0f;
+			const uint64_t inc	= phase_inc(c);
+			const float    per_inc	= 1.0f / inc;
+			uint64_t       pos	= 0;
+			uint64_t       prev_pos = 0;
+			float	       sample	= 0.0f;
 
-			c->sample = wave_sample(c->val, c->volume);
+			c->sample = wave_sample(a, c->val, c->volume);
 
-			while (update_freq(c, &pos)) {
+			while (update_freq(c, &pos, inc)) {
 				c->val = (c->val + 1) & 31;
-				sample += ((pos - prev_pos) / c->freq_inc) *
+				sample += ((pos - prev_pos) * per_inc) *
 					  (float)c->sample;
-				c->sample = wave_sample(c->val, c->volume);
+				c->sample = wave_sample(a, c->val, c->volume);
 				prev_pos  = pos;
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) *
+			sample += ((pos - prev_pos) * per_inc) *
 				  (float)c->sample;
 
 			if (c->volume > 0) {
@@ -278,22 +382,17 @@ static void update_wave(void)
 							1.5f }[c->volume - 1];
 				sample     = hipass(c, (sample - diff) / 7.5f);
 
-				if (!c->muted) {
-					samples[i + 0] += sample * 0.25f *
-							  c->on_left * vol_l;
-					samples[i + 1] += sample * 0.25f *
-							  c->on_right * vol_r;
-				}
+				mix_sample(a, c, i, sample);
 			}
 		}
 	}
+
+	return true;
 }
 
-static void update_noise(void)
+static bool update_noise(struct audio *a, const bool muted)
 {
-	struct chan *c = chans + 3;
-	if (!c->powered)
-		return;
+	struct chan *c = a->chans + 3;
 
 	float freq = 4194304.0f / (float)((size_t[]){ 8, 16, 32, 48, 64, 80, 96,
 						      112 }[c->lfsr_div]
@@ -303,96 +402,333 @@ static void update_noise(void)
 	if (c->freq >= 14)
 		c->enabled = 0;
 
-	for (unsigned int i = 0; i < nsamples; i += 2) {
-		update_len(c);
+	const bool audible = !chan_silent(a, c);
 
-		if (c->enabled) {
-			update_env(c);
+	if (!audible || muted) {
+		chan_fast_forward(a, c, a->nsamples / 2);
+		return audible;
+	}
 
-			float pos      = 0.0f;
-			float prev_pos = 0.0f;
-			float sample   = 0.0f;
+	for (unsigned int i = 0; i < a->nsamples; i += 2) {
+		update_len(a, c, 1);
 
-			while (update_freq(c, &pos)) {
-				c->lfsr_reg = (c->lfsr_reg << 1) |
-					      (c->val == 1);
+		if (c->enabled) {
+			update_env(c, 1);
 
-				if (c->lfsr_wide) {
-					c->val = !(((c->lfsr_reg >> 14) & 1) ^
-						   ((c->lfsr_reg >> 13) & 1)) ?
-							 1 :
-							 -1;
-				} else {
-					c->val = !(((c->lfsr_reg >> 6) & 1) ^
-						   ((c->lfsr_reg >> 5) & 1)) ?
-							 1 :
-							 -1;
-				}
-				sample += ((pos - prev_pos) / c->freq_inc) *
+			const uint64_t inc	= phase_inc(c);
+			const float    per_inc	= 1.0f / inc;
+			uint64_t       pos	= 0;
+			uint64_t       prev_pos = 0;
+			float	       sample	= 0.0f;
+
+			while (update_freq(c, &pos, inc)) {
+				lfsr_step(c);
+				sample += ((pos - prev_pos) * per_inc) *
 					  c->val;
 				prev_pos = pos;
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
+			sample += ((pos - prev_pos) * per_inc) * c->val;
 			sample = hipass(c, sample * (c->volume / 15.0f));
 
-			if (!c->muted) {
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * vol_l;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * vol_r;
-			}
+			mix_sample(a, c, i, sample);
 		}
 	}
+
+	return true;
 }
 
-void audio_update(void)
+static uint32_t xorshift32(uint32_t x)
 {
-	memset(samples, 0, nsamples * sizeof(float));
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
 
-	update_square(0);
-	update_square(1);
-	update_wave();
-	update_noise();
+/**
+ * Triangular dither of +/- 1 LSB, from the sum of two uniform values.
+ */
+static float tpdf_dither(struct audio *a)
+{
+	const float x = (int32_t)(a->dither_state =
+					  xorshift32(a->dither_state));
+	const float y = (int32_t)(a->dither_state =
+					  xorshift32(a->dither_state));
+
+	return (x + y) * (1.0f / 4294967296.0f);
+}
+
+static int16_t to_s16(struct audio *a, float sample)
+{
+	sample = sample * 32767.0f + (a->out_dither ? tpdf_dither(a) : 0.0f);
+	return lrintf(MAX(-32768.0f, MIN(32767.0f, sample)));
+}
+
+#ifdef __SSE2__
+static __m128 tpdf_dither_v(__m128i *state)
+{
+	__m128i x, y;
+
+#define XORSHIFT_V(v)                                         \
+	v = _mm_xor_si128(v, _mm_slli_epi32(v, 13));          \
+	v = _mm_xor_si128(v, _mm_srli_epi32(v, 17));          \
+	v = _mm_xor_si128(v, _mm_slli_epi32(v, 5));
+
+	XORSHIFT_V(*state);
+	x = *state;
+	XORSHIFT_V(*state);
+	y = *state;
+
+#undef XORSHIFT_V
 
-	sample_ptr = samples + nsamples;
+	return _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(x), _mm_cvtepi32_ps(y)),
+			  _mm_set1_ps(1.0f / 4294967296.0f));
 }
+#endif
 
 /**
- * SDL2 style audio callback function.
+ * Convert "frames" of mixed stereo float samples in place to the selected
+ * output format. The output is never larger than the input, so each write
+ * lands on data that has already been read.
  */
-void audio_callback(void *restrict const userdata,
-		uint8_t *restrict stream, int len)
+static void convert_output(struct audio *a, const unsigned int frames)
+{
+	const unsigned int n   = frames * a->out_channels;
+	float *		   buf = a->samples;
+	int16_t *	   s16 = (int16_t *)a->samples;
+	unsigned int	   i   = 0;
+
+	if (a->out_channels == 1) {
+#ifdef __SSE2__
+		for (; i + 4 <= frames; i += 4) {
+			const __m128 x = _mm_loadu_ps(buf + i * 2);
+			const __m128 y = _mm_loadu_ps(buf + i * 2 + 4);
+			const __m128 l = _mm_shuffle_ps(x, y, 0x88);
+			const __m128 r = _mm_shuffle_ps(x, y, 0xDD);
+
+			_mm_storeu_ps(buf + i, _mm_mul_ps(_mm_add_ps(l, r),
+							  _mm_set1_ps(0.5f)));
+		}
+#endif
+		for (; i < frames; ++i)
+			buf[i] = (buf[i * 2] + buf[i * 2 + 1]) * 0.5f;
+	}
+
+	if (a->out_format != AUDIO_FORMAT_S16)
+		return;
+
+	i = 0;
+#ifdef __SSE2__
+	{
+		const __m128 scale = _mm_set1_ps(32767.0f);
+		__m128i dither = _mm_load_si128((__m128i *)a->dither_lanes);
+
+		for (; i + 8 <= n; i += 8) {
+			__m128 x = _mm_mul_ps(_mm_loadu_ps(buf + i), scale);
+			__m128 y = _mm_mul_ps(_mm_loadu_ps(buf + i + 4), scale);
+
+			if (a->out_dither) {
+				x = _mm_add_ps(x, tpdf_dither_v(&dither));
+				y = _mm_add_ps(y, tpdf_dither_v(&dither));
+			}
+
+			/* Pack with signed saturation to clip out of range
+			 * samples. */
+			_mm_storeu_si128((__m128i *)(s16 + i),
+					 _mm_packs_epi32(_mm_cvtps_epi32(x),
+							 _mm_cvtps_epi32(y)));
+		}
+
+		_mm_store_si128((__m128i *)a->dither_lanes, dither);
+	}
+#endif
+	for (; i < n; ++i)
+		s16[i] = to_s16(a, buf[i]);
+}
+
+void audio_set_output(struct audio *a, const enum audio_format fmt,
+		      const unsigned int channels, const bool dither)
+{
+	a->out_format	= fmt;
+	a->out_channels = channels;
+	a->out_dither	= dither;
+	a->frame_size	= channels * (fmt == AUDIO_FORMAT_S16 ?
+					      sizeof(int16_t) :
+					      sizeof(float));
+	a->pending	= 0;
+
+	a->dither_state	   = 0x12345678;
+	a->dither_lanes[0] = 0xC2B2AE35;
+	a->dither_lanes[1] = 0x85EBCA6B;
+	a->dither_lanes[2] = 0x7F4A7C15;
+	a->dither_lanes[3] = 0x9E3779B9;
+}
+
+unsigned int audio_frame_size(const struct audio *a)
+{
+	return a->frame_size;
+}
+
+void audio_update(struct audio *a)
+{
+	const unsigned int mutes = __atomic_load_n(&a->mute_mask,
+						   __ATOMIC_RELAXED);
+	unsigned int	   frames;
+	unsigned int	   audible = 0;
+
+	a->play_frac += a->play_frames;
+	frames	      = a->play_frac;
+	a->play_frac -= frames;
+	a->nsamples   = frames * 2;
+
+	memset(a->samples, 0, a->nsamples * sizeof(float));
+
+	if (a->stems_enabled) {
+		for (unsigned int i = 0; i < 4; ++i)
+			memset(a->stem_samples[i], 0,
+			       a->nsamples * sizeof(float));
+	}
+
+	audible |= update_square(a, 0, mutes & 1) << 0;
+	audible |= update_square(a, 1, mutes & 2) << 1;
+	audible |= update_wave(a, mutes & 4) << 2;
+	audible |= update_noise(a, mutes & 8) << 3;
+
+	a->block_silent = (audible & ~mutes) == 0;
+
+	a->block_frames	 = a->nsamples / 2;
+	a->silent_frames = audible ? 0 : a->silent_frames + a->block_frames;
+	convert_output(a, a->block_frames);
+	a->pending = a->block_frames;
+}
+
+void audio_mix(struct audio *a, const float *const chans[4],
+	       const unsigned int frames)
+{
+	a->nsamples = frames * 2;
+
+	/* Added in the same order as audio_update() mixes channels. */
+	for (unsigned int i = 0; i < a->nsamples; ++i) {
+		a->samples[i] = chans[0][i];
+		a->samples[i] += chans[1][i];
+		a->samples[i] += chans[2][i];
+		a->samples[i] += chans[3][i];
+	}
+
+	a->block_silent	 = false;
+	a->silent_frames = 0;
+	a->block_frames	 = frames;
+	convert_output(a, frames);
+	a->pending = frames;
+}
+
+bool audio_silent(const struct audio *a)
+{
+	return a->block_silent;
+}
+
+uint64_t audio_silent_frames(const struct audio *a)
 {
-	(void)userdata;
+	return a->silent_frames;
+}
 
-	/* Optimisation: len = len / sizeof(float) */
-	len >>= 2;
+void audio_mute(struct audio *a, const unsigned int chan, const bool mute)
+{
+	if (mute)
+		__atomic_fetch_or(&a->mute_mask, 1U << chan, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_and(&a->mute_mask, ~(1U << chan),
+				   __ATOMIC_RELAXED);
+}
 
-	do {
-		unsigned int n;
+bool audio_muted(const struct audio *a, const unsigned int chan)
+{
+	return __atomic_load_n(&a->mute_mask, __ATOMIC_RELAXED) & (1U << chan);
+}
 
-		if (sample_ptr - samples == 0)
-		{
-			process_cpu();
-			audio_update();
+void audio_solo(struct audio *a, const unsigned int chan)
+{
+	const unsigned int mutes = __atomic_load_n(&a->mute_mask,
+						   __ATOMIC_RELAXED);
+	const unsigned int others = 0xF & ~(1U << chan);
+
+	/* Soloing the already soloed channel brings all channels back. */
+	__atomic_store_n(&a->mute_mask, mutes == others ? 0 : others,
+			 __ATOMIC_RELAXED);
+}
+
+unsigned int audio_render(struct minigbs *gbs, void *restrict out,
+			  float *stems[4], unsigned int frames)
+{
+	const unsigned int frames_total = frames;
+	struct audio *a	    = &gbs->audio;
+	uint8_t *     dst   = out;
+	float *	      stem_dst[4];
+	unsigned int  calls = 0;
+
+	if (stems != NULL)
+		memcpy(stem_dst, stems, sizeof(stem_dst));
+
+	while (frames) {
+		unsigned int n, off;
+
+		/* Short blocks may hold no frames at fast play rates. */
+		while (a->pending == 0) {
+			process_cpu(gbs);
+			audio_update(a);
+			calls++;
+
+			if (gbs->vgm != NULL)
+				vgm_wait(gbs->vgm, a->block_frames);
 		}
 
-		n = MIN(len, sample_ptr - samples);
-		memcpy(stream, samples, n * sizeof(float));
-		memmove(samples, samples + n, (nsamples - n) * sizeof(float));
+		/* Consume the block from the front, without moving it. */
+		n   = MIN(frames, a->pending);
+		off = a->block_frames - a->pending;
+		memcpy(dst, (uint8_t *)a->samples + off * a->frame_size,
+		       n * a->frame_size);
+
+		if (stems != NULL) {
+			for (unsigned int i = 0; i < 4; ++i) {
+				memcpy(stem_dst[i],
+				       a->stem_samples[i] + off * 2,
+				       n * 2 * sizeof(float));
+				stem_dst[i] += n * 2;
+			}
+		}
+
+		dst += (n * a->frame_size);
+		a->pending -= n;
+		frames -= n;
+	}
 
-		stream += (n * sizeof(float));
-		sample_ptr -= n;
-		len -= n;
-	} while (len);
+	gbs->position += frames_total;
+	return calls;
 }
 
-static void audio_update_rate(void)
+/**
+ * SDL2 style audio callback function.
+ */
+void audio_callback(void *restrict const userdata,
+		uint8_t *restrict stream, int len)
+{
+	struct minigbs *gbs = userdata;
+
+	audio_render(gbs, stream, NULL, len / gbs->audio.frame_size);
+}
+
+void audio_set_block(struct audio *a, const unsigned int frames)
+{
+	a->play_frames = frames;
+	a->play_frac   = 0;
+}
+
+static void audio_update_rate(struct audio *a)
 {
 	float audio_rate = VERTICAL_SYNC;
 
-	const uint8_t tma = audio_mem[0xff06 - AUDIO_ADDR_COMPENSATION];
-	const uint8_t tac = audio_mem[0xff07 - AUDIO_ADDR_COMPENSATION];
+	const uint8_t tma = a->mem[0xff06 - AUDIO_ADDR_COMPENSATION];
+	const uint8_t tac = a->mem[0xff07 - AUDIO_ADDR_COMPENSATION];
 
 	if (tac & 0x04) {
 		const int rates[] = { 4096, 262144, 65536, 16384 };
@@ -401,23 +737,35 @@ static void audio_update_rate(void)
 			audio_rate *= 2.0f;
 	}
 
-	free(samples);
-	nsamples   = (int)(AUDIO_SAMPLE_RATE / audio_rate) * 2;
-	samples    = calloc(nsamples, sizeof(float));
-	sample_ptr = samples;
+	/* Takes effect from the next block; pending output is kept. */
+	a->play_frames = MIN(AUDIO_SAMPLE_RATE / audio_rate,
+			     (double)AUDIO_MAX_FRAMES);
+}
+
+int audio_stems(struct audio *a, const bool enable)
+{
+	/* Allocated on first use, as most instances never render stems. */
+	if (enable && a->stem_samples == NULL) {
+		a->stem_samples = calloc(4, sizeof(*a->stem_samples));
+		if (a->stem_samples == NULL)
+			return -1;
+	}
+
+	a->stems_enabled = enable;
+	return 0;
 }
 
-static void chan_trigger(int i)
+static void chan_trigger(struct audio *a, int i)
 {
-	struct chan *c = chans + i;
+	struct chan *c = a->chans + i;
 
-	chan_enable(i, 1);
+	chan_enable(a, i, 1);
 	c->volume = c->volume_init;
 
 	// volume envelope
 	{
 		uint8_t val =
-			audio_mem[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION];
+			a->mem[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION];
 
 		c->env.step = val & 0x07;
 		c->env.up   = val & 0x08;
@@ -429,7 +777,7 @@ static void chan_trigger(int i)
 
 	// freq sweep
 	if (i == 0) {
-		uint8_t val = audio_mem[0xFF10 - AUDIO_ADDR_COMPENSATION];
+		uint8_t val = a->mem[0xFF10 - AUDIO_ADDR_COMPENSATION];
 
 		c->sweep.freq  = c->freq;
 		c->sweep.rate  = (val >> 4) & 0x07;
@@ -463,7 +811,7 @@ static void chan_trigger(int i)
  *				This is not checked in this function.
  * \return		Byte at address.
  */
-uint8_t audio_read(const uint16_t addr)
+uint8_t audio_read(const struct audio *a, const uint16_t addr)
 {
 	static uint8_t ortab[] = { 0x80, 0x3f, 0x00, 0xff, 0xbf, 0xff,
 				   0x3f, 0x00, 0xff, 0xbf, 0x7f, 0xff,
@@ -471,12 +819,12 @@ uint8_t audio_read(const uint16_t addr)
 				   0x00, 0xbf, 0x00, 0x00, 0x70 };
 
 	if (addr > 0xFF26)
-		return audio_mem[addr - AUDIO_ADDR_COMPENSATION];
+		return a->mem[addr - AUDIO_ADDR_COMPENSATION];
 	else if (addr >= 0xFF10)
-		return audio_mem[addr - AUDIO_ADDR_COMPENSATION] |
+		return a->mem[addr - AUDIO_ADDR_COMPENSATION] |
 		       ortab[addr - 0xFF10];
 
-	return audio_mem[addr - AUDIO_ADDR_COMPENSATION];
+	return a->mem[addr - AUDIO_ADDR_COMPENSATION];
 }
 
 /**
@@ -485,111 +833,116 @@ uint8_t audio_read(const uint16_t addr)
  *				This is not checked in this function.
  * \param val	Byte to write at address.
  */
-void audio_write(const uint16_t addr, const uint8_t val)
+void audio_write(struct audio *a, const uint16_t addr, const uint8_t val)
 {
 	/* Find sound channel corresponding to register address. */
-	int i					  = (addr - 0xFF10) / 5;
-	audio_mem[addr - AUDIO_ADDR_COMPENSATION] = val;
+	int i				       = (addr - 0xFF10) / 5;
+	a->mem[addr - AUDIO_ADDR_COMPENSATION] = val;
 
 	switch (addr) {
 	case 0xFF06:
 	case 0xFF07:
-		audio_update_rate();
+		audio_update_rate(a);
 		break;
 
 	case 0xFF12:
 	case 0xFF17:
 	case 0xFF21: {
-		chans[i].volume_init = val >> 4;
-		chans[i].powered     = (val >> 3) != 0;
+		struct chan *c = a->chans + i;
+
+		c->volume_init = val >> 4;
+		c->powered     = (val >> 3) != 0;
 
 		// "zombie mode" stuff, needed for Prehistorik Man and probably
 		// others
-		if (chans[i].powered && chans[i].enabled) {
-			if ((chans[i].env.step == 0 && chans[i].env.inc != 0)) {
+		if (c->powered && c->enabled) {
+			if ((c->env.step == 0 && c->env.inc != 0)) {
 				if (val & 0x08) {
-					chans[i].volume++;
+					c->volume++;
 				} else {
-					chans[i].volume += 2;
+					c->volume += 2;
 				}
 			} else {
-				chans[i].volume = 16 - chans[i].volume;
+				c->volume = 16 - c->volume;
 			}
 
-			chans[i].volume &= 0x0F;
-			chans[i].env.step = val & 0x07;
+			c->volume &= 0x0F;
+			c->env.step = val & 0x07;
 		}
 	} break;
 
 	case 0xFF1C:
-		chans[i].volume = chans[i].volume_init = (val >> 5) & 0x03;
+		a->chans[i].volume = a->chans[i].volume_init =
+			(val >> 5) & 0x03;
 		break;
 
 	case 0xFF11:
 	case 0xFF16:
 	case 0xFF20: {
 		const uint8_t duty_lookup[] = { 0x10, 0x30, 0x3C, 0xCF };
-		chans[i].len.load	   = val & 0x3f;
-		chans[i].duty		    = duty_lookup[val >> 6];
+		a->chans[i].len.load	    = val & 0x3f;
+		a->chans[i].duty	    = duty_lookup[val >> 6];
 		break;
 	}
 
 	case 0xFF1B:
-		chans[i].len.load = val;
+		a->chans[i].len.load = val;
 		break;
 
 	case 0xFF13:
 	case 0xFF18:
 	case 0xFF1D:
-		chans[i].freq &= 0xFF00;
-		chans[i].freq |= val;
+		a->chans[i].freq &= 0xFF00;
+		a->chans[i].freq |= val;
 		break;
 
 	case 0xFF1A:
-		chans[i].powered = (val & 0x80) != 0;
-		chan_enable(i, val & 0x80);
+		a->chans[i].powered = (val & 0x80) != 0;
+		chan_enable(a, i, val & 0x80);
 		break;
 
 	case 0xFF14:
 	case 0xFF19:
 	case 0xFF1E:
-		chans[i].freq &= 0x00FF;
-		chans[i].freq |= ((val & 0x07) << 8);
+		a->chans[i].freq &= 0x00FF;
+		a->chans[i].freq |= ((val & 0x07) << 8);
 		/* Intentional fall-through. */
 	case 0xFF23:
-		chans[i].len.enabled = val & 0x40;
+		a->chans[i].len.enabled = val & 0x40;
 		if (val & 0x80)
-			chan_trigger(i);
+			chan_trigger(a, i);
 
 		break;
 
 	case 0xFF22:
-		chans[3].freq      = val >> 4;
-		chans[3].lfsr_wide = !(val & 0x08);
-		chans[3].lfsr_div  = val & 0x07;
+		a->chans[3].freq      = val >> 4;
+		a->chans[3].lfsr_wide = !(val & 0x08);
+		a->chans[3].lfsr_div  = val & 0x07;
 		break;
 
 	case 0xFF24:
-		vol_l = ((val >> 4) & 0x07) / 7.0f;
-		vol_r = (val & 0x07) / 7.0f;
+		a->vol_l = ((val >> 4) & 0x07) / 7.0f;
+		a->vol_r = (val & 0x07) / 7.0f;
 		break;
 
 	case 0xFF25:
 		for (int i = 0; i < 4; ++i) {
-			chans[i].on_left  = (val >> (4 + i)) & 1;
-			chans[i].on_right = (val >> i) & 1;
+			a->chans[i].on_left  = (val >> (4 + i)) & 1;
+			a->chans[i].on_right = (val >> i) & 1;
 		}
 		break;
 	}
 }
 
-void audio_init(void)
+void audio_init(struct audio *a)
 {
 	/* Initialise channels and samples. */
-	memset(chans, 0, sizeof(chans));
-	memset(samples, 0, nsamples * sizeof(float));
-	sample_ptr   = samples;
-	chans[0].val = chans[1].val = -1;
+	memset(a->chans, 0, sizeof(a->chans));
+	memset(a->samples, 0, sizeof(a->samples));
+	a->pending       = 0;
+	a->play_frac     = 0;
+	a->silent_frames = 0;
+	a->chans[0].val = a->chans[1].val = -1;
 
 	/* Initialise IO registers. */
 	{
@@ -600,7 +953,7 @@ void audio_init(void)
 					      0x77, 0xF3, 0xF1 };
 
 		for(uint_least8_t i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			audio_write(a, 0xFF10 + i, regs_init[i]);
 	}
 
 	/* Initialise Wave Pattern RAM. */
@@ -611,16 +964,17 @@ void audio_init(void)
 					      0xac, 0xdd, 0xda, 0x48 };
 
 		for(uint_least8_t i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			audio_write(a, 0xFF30 + i, wave_init[i]);
 	}
 
-	audio_update_rate();
+	audio_update_rate(a);
 }
 
-void audio_deinit(void)
+void audio_deinit(struct audio *a)
 {
-	if(samples != NULL)
-		free(samples);
+	a->pending	 = 0;
+	a->stems_enabled = false;
 
-	samples = NULL;
+	free(a->stem_samples);
+	a->stem_samples = NULL;
 }
@@ -1,29 +1,245 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdbool.h>
 #include <stdint.h>
 
 #define AUDIO_SAMPLE_RATE 48000.0f
 
+#define AUDIO_MEM_SIZE (0xFF3F - 0xFF06 + 1)
+
+/* Slowest play rate is the 4096 Hz timer with TMA of 0, giving 16 Hz. */
+#define AUDIO_MAX_FRAMES ((int)AUDIO_SAMPLE_RATE / 16)
+
+struct minigbs;
+
+enum audio_format {
+	AUDIO_FORMAT_F32,
+	AUDIO_FORMAT_S16
+};
+
+struct chan_len_ctr {
+	int   load;
+	bool  enabled;
+	float counter;
+	float inc;
+};
+
+struct chan_vol_env {
+	int   step;
+	bool  up;
+	float counter;
+	float inc;
+};
+
+struct chan_freq_sweep {
+	int   freq;
+	int   rate;
+	bool  up;
+	int   shift;
+	float counter;
+	float inc;
+};
+
+struct chan {
+	unsigned int enabled : 1;
+	unsigned int powered : 1;
+	unsigned int on_left : 1;
+	unsigned int on_right : 1;
+
+	unsigned int volume : 4;
+	unsigned int volume_init : 4;
+
+	uint16_t freq;
+	uint32_t freq_counter;
+	float    freq_inc;
+
+	int val;
+	int note;
+
+	struct chan_len_ctr    len;
+	struct chan_vol_env    env;
+	struct chan_freq_sweep sweep;
+
+	float capacitor;
+
+	// square
+	uint8_t duty;
+	uint8_t duty_counter;
+
+	// noise
+	uint16_t lfsr_reg;
+	bool     lfsr_wide;
+	int      lfsr_div;
+
+	// wave
+	uint8_t sample;
+};
+
 /**
- * Fill allocated buffer "data" with "len" number of 32-bit floating point
- * samples (native endian order) in stereo interleaved format.
+ * State of one audio processing unit and its output buffers.
+ */
+struct audio {
+	/* Audio registers between 0xFF06 and 0xFF3F inclusive. */
+	uint8_t mem[AUDIO_MEM_SIZE];
+
+	struct chan chans[4];
+	float	    vol_l, vol_r;
+
+	/* Frames between play calls at the current play rate, and the fraction
+	 * of a frame carried over from the previous block. */
+	double play_frames;
+	double play_frac;
+
+	/* Samples in the current block. */
+	unsigned int nsamples;
+
+	/* Frames in the last block and those not yet consumed. */
+	unsigned int block_frames;
+	unsigned int pending;
+
+	/* Set when no channel rendered anything into the last block, and the
+	 * frames of the blocks since the last one any channel was audible in,
+	 * whether muted or not. */
+	bool	 block_silent;
+	uint64_t silent_frames;
+
+	/* Output format; samples are converted in place after mixing. */
+	enum audio_format out_format;
+	unsigned int	  out_channels;
+	bool		  out_dither;
+	unsigned int	  frame_size;
+
+	/* State of the xorshift generators used for dither. */
+	uint32_t dither_state;
+	uint32_t dither_lanes[4] __attribute__((aligned(16)));
+
+	/* Per-channel output, only allocated once stems are enabled. */
+	bool stems_enabled;
+	float (*stem_samples)[AUDIO_MAX_FRAMES * 2];
+
+	/* Channels muted by the listener, one bit per channel. Changed from
+	 * other threads while blocks render, so only accessed atomically, and
+	 * read once per block. Not part of saved states. */
+	unsigned int mute_mask;
+
+	float samples[AUDIO_MAX_FRAMES * 2] __attribute__((aligned(64)));
+};
+
+/**
+ * Fill allocated buffer "data" with "len" bytes of samples (native endian
+ * order) in the format selected with audio_set_output(). By default, samples
+ * are 32-bit floating point in stereo interleaved format.
+ * "ptr" is the struct minigbs instance to run.
  */
 void audio_callback(void *ptr, uint8_t *data, int len);
 
+/**
+ * Fill "out" with exactly "frames" frames in the format selected with
+ * audio_set_output(), calling the play routine of "gbs" whenever the
+ * previous block has been consumed. If "stems" is not NULL, each of its four
+ * buffers also receives "frames" frames of a single channel; see
+ * audio_stems(). Never allocates memory.
+ * \return	Number of play routine calls made.
+ */
+unsigned int audio_render(struct minigbs *gbs, void *out, float *stems[4],
+			  unsigned int frames);
+
+/**
+ * Select the sample format "fmt" and number of "channels" (1 or 2) produced by
+ * audio_callback(). Conversion is done directly after mixing. With "dither",
+ * triangular dither is added before rounding to 16-bit samples.
+ * Any samples not yet consumed by audio_callback() are discarded.
+ */
+void audio_set_output(struct audio *a, enum audio_format fmt,
+		      unsigned int channels, bool dither);
+
+/**
+ * Size of one frame of output in bytes.
+ */
+unsigned int audio_frame_size(const struct audio *a);
+
+/**
+ * Enable or disable rendering of per-channel stems. Stems are always 32-bit
+ * floating point stereo, taken after high-pass filtering and panning, but
+ * before master volume and mixing.
+ * \return	0 on success, or -1 if the stem buffers could not be allocated.
+ */
+int audio_stems(struct audio *a, bool enable);
+
+/**
+ * Render one block of samples, as long as the current play rate allows. The
+ * fractional part of the play period is carried over to the next block, so
+ * that blocks average out to the exact play rate.
+ */
+void audio_update(struct audio *a);
+
+/**
+ * Make the next audio_update() render exactly "frames" frames, at most
+ * AUDIO_MAX_FRAMES, regardless of the play rate. Used to replay register
+ * logs, whose blocks keep the lengths they were recorded with.
+ */
+void audio_set_block(struct audio *a, unsigned int frames);
+
+/**
+ * Make a block of "frames" frames, at most AUDIO_MAX_FRAMES, from the four
+ * stereo floating point blocks in "chans", each rendered by a copy of "a"
+ * playing a single channel with F32 stereo output. The block is converted to
+ * the output format of "a" and then consumed like one from audio_update().
+ */
+void audio_mix(struct audio *a, const float *const chans[4],
+	       unsigned int frames);
+
+/**
+ * Whether no channel rendered any output into the most recent block. Sinks may
+ * skip processing of such blocks, as they contain only silence.
+ */
+bool audio_silent(const struct audio *a);
+
+/**
+ * Frames of output in the blocks since the last one any channel was audible in,
+ * up to and including the most recent block. Muted channels still count as
+ * audible, so that muting does not change where a song is found to end.
+ */
+uint64_t audio_silent_frames(const struct audio *a);
+
+/**
+ * Mute or unmute channel "chan" (0 to 3). A muted channel is not synthesised;
+ * only its timers and phase keep advancing. Safe to call from another thread
+ * while "a" renders; the change applies from the next block.
+ */
+void audio_mute(struct audio *a, unsigned int chan, bool mute);
+
+/**
+ * Whether channel "chan" (0 to 3) is muted.
+ */
+bool audio_muted(const struct audio *a, unsigned int chan);
+
+/**
+ * Mute every channel except "chan" (0 to 3). Soloing a channel that is
+ * already soloed unmutes all channels.
+ */
+void audio_solo(struct audio *a, unsigned int chan);
+
 /**
  * Read audio register at given address "addr".
  */
-uint8_t audio_read(const uint16_t addr);
+uint8_t audio_read(const struct audio *a, const uint16_t addr);
 
 /**
  * Write "val" to audio register at given address "addr".
  */
-void audio_write(const uint16_t addr, const uint8_t val);
+void audio_write(struct audio *a, const uint16_t addr, const uint8_t val);
 
 /**
  * Initialise audio driver.
  */
-void audio_init(void);
+void audio_init(struct audio *a);
 
 /**
- * Frees memory used by audio driver.
+ * Stops audio driver, discarding any output not yet consumed and freeing the
+ * stem buffers.
  */
-void audio_deinit(void);
+void audio_deinit(struct audio *a);
+
+#endif
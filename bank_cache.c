@@ -0,0 +1,89 @@
+#include "bank_cache.h"
+#include "minigbs.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BANK_CACHE_BUCKETS	1024
+
+struct bank_entry {
+	struct bank_entry *next;
+	uint64_t	   hash;
+	unsigned int	   refs;
+	uint8_t		   data[ROM_BANK_SIZE];
+};
+
+static pthread_mutex_t	   bank_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bank_entry * bank_cache[BANK_CACHE_BUCKETS];
+
+/**
+ * FNV-1a over 64-bit words of the bank.
+ */
+static uint64_t bank_hash(const uint8_t *page)
+{
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (size_t i = 0; i < ROM_BANK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+
+		memcpy(&word, page + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001B3;
+	}
+
+	return hash ^ (hash >> 32);
+}
+
+const uint8_t *bank_cache_get(const uint8_t *page)
+{
+	const uint64_t	    hash = bank_hash(page);
+	struct bank_entry **bucket = &bank_cache[hash % BANK_CACHE_BUCKETS];
+	struct bank_entry * e;
+
+	pthread_mutex_lock(&bank_cache_lock);
+
+	for (e = *bucket; e != NULL; e = e->next) {
+		if (e->hash == hash &&
+		    memcmp(e->data, page, ROM_BANK_SIZE) == 0) {
+			e->refs++;
+			goto out;
+		}
+	}
+
+	if ((e = malloc(sizeof(*e))) != NULL) {
+		e->hash = hash;
+		e->refs = 1;
+		memcpy(e->data, page, ROM_BANK_SIZE);
+		e->next = *bucket;
+		*bucket = e;
+	}
+
+out:
+	pthread_mutex_unlock(&bank_cache_lock);
+	return e != NULL ? e->data : NULL;
+}
+
+void bank_cache_put(const uint8_t *bank)
+{
+	struct bank_entry * e;
+	struct bank_entry **link;
+
+	if (bank == NULL)
+		return;
+
+	e = (struct bank_entry *)(bank - offsetof(struct bank_entry, data));
+
+	pthread_mutex_lock(&bank_cache_lock);
+
+	if (--e->refs == 0) {
+		for (link = &bank_cache[e->hash % BANK_CACHE_BUCKETS];
+		     *link != e; link = &(*link)->next)
+			;
+
+		*link = e->next;
+		free(e);
+	}
+
+	pthread_mutex_unlock(&bank_cache_lock);
+}
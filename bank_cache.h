@@ -0,0 +1,20 @@
+#ifndef BANK_CACHE_H
+#define BANK_CACHE_H
+
+#include <stdint.h>
+
+/**
+ * Return a shared, read-only copy of the ROM bank "page", which is
+ * ROM_BANK_SIZE bytes long. Banks with identical contents share a single
+ * copy across all instances in the process. Safe to call from any thread.
+ * \return	Shared copy, or NULL if memory could not be allocated.
+ */
+const uint8_t *bank_cache_get(const uint8_t *page);
+
+/**
+ * Drop a reference to a bank returned by bank_cache_get(), freeing it once no
+ * instance uses it any more. Does nothing if "bank" is NULL.
+ */
+void bank_cache_put(const uint8_t *bank);
+
+#endif
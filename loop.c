@@ -0,0 +1,124 @@
+#include "loop.h"
+#include "memo.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Initial size of the table of states seen, a power of two. It is doubled
+ * whenever it is half full. */
+#define LOOP_INITIAL_SLOTS	4096
+
+/**
+ * Key of a state a call started from, with the calls and frames before it.
+ */
+struct loop_seen {
+	uint64_t key;
+	uint64_t calls;
+	uint64_t frames;
+};
+
+/**
+ * Slot holding "key" in the table "slots" of "size" slots, or the empty slot
+ * where it would go.
+ */
+static struct loop_seen *loop_slot(struct loop_seen *slots, const size_t size,
+				   const uint64_t key)
+{
+	size_t i = key & (size - 1);
+
+	while (slots[i].key != 0 && slots[i].key != key)
+		i = (i + 1) & (size - 1);
+
+	return &slots[i];
+}
+
+/**
+ * Double the size of the table "*slots" of "*size" slots.
+ * \return	false if memory could not be allocated.
+ */
+static bool loop_grow(struct loop_seen **slots, size_t *size)
+{
+	const size_t	  n = *size * 2;
+	struct loop_seen *grown;
+
+	if ((grown = calloc(n, sizeof(*grown))) == NULL)
+		return false;
+
+	for (size_t i = 0; i < *size; ++i) {
+		if ((*slots)[i].key != 0)
+			*loop_slot(grown, n, (*slots)[i].key) = (*slots)[i];
+	}
+
+	free(*slots);
+	*slots = grown;
+	*size  = n;
+	return true;
+}
+
+int loop_find(const struct minigbs *gbs, const uint64_t max_frames,
+	      struct loop_info *info)
+{
+	struct memo_state state = { .dirty = ~0ULL };
+	struct loop_seen *slots;
+	size_t		  size	= LOOP_INITIAL_SLOTS;
+	size_t		  used	= 0;
+	uint64_t	  calls = 0;
+	uint64_t	  frames;
+	struct minigbs *  cpu;
+	int		  ret = 0;
+
+	if (gbs->replay != NULL)
+		return 0;
+
+	if ((slots = calloc(size, sizeof(*slots))) == NULL)
+		return -1;
+
+	if ((cpu = minigbs_clone(gbs)) == NULL) {
+		free(slots);
+		return -1;
+	}
+
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&cpu->audio, c, true);
+
+	/* The first call comes after the frames still pending. */
+	frames = cpu->audio.pending;
+
+	while (frames <= max_frames) {
+		struct loop_seen *s;
+		uint64_t	  key;
+
+		/* Nothing else uses the write marks of the copy. */
+		state.dirty |= cpu->ram_dirty;
+		cpu->ram_dirty = 0;
+
+		key = memo_key(&state, cpu);
+		s   = loop_slot(slots, size, key);
+
+		if (s->key == key) {
+			info->intro_calls  = s->calls;
+			info->intro_frames = s->frames;
+			info->loop_calls   = calls - s->calls;
+			info->loop_frames  = frames - s->frames;
+			ret		   = 1;
+			break;
+		}
+
+		s->key	  = key;
+		s->calls  = calls;
+		s->frames = frames;
+
+		if (++used * 2 > size && !loop_grow(&slots, &size)) {
+			ret = -1;
+			break;
+		}
+
+		process_cpu(cpu);
+		audio_update(&cpu->audio);
+		frames += cpu->audio.block_frames;
+		calls++;
+	}
+
+	minigbs_destroy(cpu);
+	free(slots);
+	return ret;
+}
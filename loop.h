@@ -0,0 +1,32 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/**
+ * Where a song starts repeating, counted from where it was searched from, in
+ * play calls and in frames at AUDIO_SAMPLE_RATE.
+ */
+struct loop_info {
+	uint64_t intro_calls;
+	uint64_t intro_frames;
+	uint64_t loop_calls;
+	uint64_t loop_frames;
+};
+
+/**
+ * Find the first play call at which the song playing in "gbs" starts from a
+ * state it has started a call from before, searching at most "max_frames"
+ * frames ahead. States are compared by a hash of everything the play routine
+ * can read, so from there on it makes the same writes again and again. Only
+ * the play routine runs, on a muted copy of "gbs", which is not advanced.
+ * Register logs are never searched, as they do not repeat by state.
+ * \return	1 if a loop was found and stored in "info", 0 if not, or -1 if
+ *		memory could not be allocated.
+ */
+int loop_find(const struct minigbs *gbs, uint64_t max_frames,
+	      struct loop_info *info);
+
+#endif
@@ -0,0 +1,883 @@
+#include "minigbs.h"
+#include "audio.h"
+#include "loop.h"
+#include "memo.h"
+#include "pipeline.h"
+#include "reglog.h"
+#include "render.h"
+#include "rewind.h"
+#include "seek.h"
+#include "silence.h"
+#include "segment.h"
+#include "shard.h"
+#include "twophase.h"
+#include "vgm.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef AUDIO_DRIVER_SDL
+#include <SDL2/SDL.h>
+#endif
+
+#ifdef AUDIO_DRIVER_SOKOL
+#define SOKOL_IMPL
+#include "sokol_audio.h"
+#endif
+
+#ifdef AUDIO_DRIVER_MINIAL
+#define MINI_AL_IMPLEMENTATION
+#include "mini_al.h"
+#endif
+
+#define RENDER_DEFAULT_SECONDS	180.0f
+#define SEEK_INTERVAL_SECONDS	10.0f
+
+/* Furthest a loop is searched for, which also bounds its length. */
+#define LOOP_SEARCH_SECONDS	3600
+
+/* Enough for several minutes of history of most songs. */
+#define REWIND_BUFFER_SIZE	(2 * 1024 * 1024)
+#define REWIND_STEP_SECONDS	5.0f
+
+/**
+ * Song playing live, with its rewind history. Keys are read on another thread
+ * than the one running the audio callback, so rewinds and song changes are
+ * requested through "rewind_frames" and "song_request", and carried out by the
+ * callback. With "pipe", the play routine runs on a thread of its own instead,
+ * without rewind history, and "audio" is the APU being synthesised. "song" is
+ * the song last selected. With "end_frames", the next song is started once the
+ * one playing has been heard and then stayed silent for that many frames;
+ * "played" counts the frames played since it started. Without "pipe", and
+ * unless "idx" is NULL, snapshots are recorded into "idx" while its song plays,
+ * which "indexing" is set for.
+ */
+struct player {
+	struct minigbs *    gbs;
+	struct audio *	    audio;
+	struct pipeline *   pipe;
+	struct rewind	    rw;
+	unsigned int	    rewind_frames;
+	int		    song_request;
+	unsigned int	    song;
+	uint64_t	    end_frames;
+	uint64_t	    played;
+	struct seek_index * idx;
+	bool		    indexing;
+};
+
+/**
+ * Ask the audio callback to start song "song".
+ */
+static void player_song(struct player *p, const unsigned int song)
+{
+	__atomic_store_n(&p->song, song, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->song_request, (int)song, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start song "song" from the audio callback.
+ */
+static void player_start(struct player *p, const unsigned int song)
+{
+	__atomic_store_n(&p->song, song, __ATOMIC_RELAXED);
+	p->played   = 0;
+	p->indexing = p->idx != NULL && song == p->idx->song;
+
+	if (p->pipe != NULL)
+		pipeline_song(p->pipe, song);
+	else
+		minigbs_song(p->gbs, song);
+}
+
+/**
+ * Start the next song if the one playing has ended after "frames" more frames
+ * were played.
+ */
+static void player_check_end(struct player *p, const unsigned int frames)
+{
+	const uint64_t	   silent = audio_silent_frames(p->audio);
+	const uint64_t	   played = (p->played += frames);
+	const unsigned int song	  = __atomic_load_n(&p->song, __ATOMIC_RELAXED);
+
+	/* Silence left over from the previous song does not count. */
+	if (p->end_frames == 0 || silent < p->end_frames || silent >= played ||
+	    song + 1U >= p->gbs->h.song_count)
+		return;
+
+	player_start(p, song + 1);
+	fprintf(stdout, "Song %u of %u\n", song + 1, p->gbs->h.song_count - 1U);
+}
+
+static void player_callback(void *ptr, uint8_t *data, int len)
+{
+	struct player *	   p	   = ptr;
+	const unsigned int request = len / audio_frame_size(p->audio);
+	unsigned int	   frames;
+	int		   song;
+
+	song = __atomic_exchange_n(&p->song_request, -1, __ATOMIC_ACQUIRE);
+	if (song >= 0)
+		player_start(p, song);
+
+	if (p->pipe != NULL) {
+		pipeline_render(p->pipe, data, request);
+		player_check_end(p, request);
+		return;
+	}
+
+	frames = __atomic_exchange_n(&p->rewind_frames, 0, __ATOMIC_ACQUIRE);
+	if (frames > 0)
+		rewind_back(p->gbs, &p->rw, frames);
+
+	/* Blocks end where the next snapshot is due. */
+	for (unsigned int done = 0, n; done < request; done += n) {
+		int next;
+
+		n = request - done;
+		if (p->indexing) {
+			if ((next = seek_next(p->gbs, p->idx, n)) < 0) {
+				/* Out of memory; keep playing without. */
+				p->indexing = false;
+			} else {
+				n = next;
+			}
+		}
+
+		rewind_render(p->gbs, &p->rw,
+			      data + done * audio_frame_size(p->audio), n);
+	}
+
+	player_check_end(p, request);
+}
+
+static void print_channels(const struct audio *a)
+{
+	fprintf(stdout, "Channels:");
+
+	for (unsigned int i = 0; i < 4; ++i) {
+		if (audio_muted(a, i))
+			fprintf(stdout, " -");
+		else
+			fprintf(stdout, " %u", i + 1);
+	}
+
+	fprintf(stdout, "\n");
+}
+
+/**
+ * Load the register log or VGM file at "path" into "log" and play it in "gbs"
+ * instead of a GBS file.
+ * \return	0 on success, or -1 with errno set; EINVAL if the file is
+ *		neither.
+ */
+static int replay_load(struct minigbs *gbs, struct reglog *log,
+		       const char *path)
+{
+	struct GBSHeader h = { .song_count = 1 };
+
+	if (reglog_load(log, &h, path) != 0 &&
+	    (errno != EINVAL || vgm_load(log, path) != 0))
+		return -1;
+
+	minigbs_replay(gbs, log, &h);
+	return 0;
+}
+
+#ifdef AUDIO_DRIVER_SOKOL
+/* Sokol has no user data pointer for its stream callback. */
+static struct player *sokol_player;
+
+void sokol_audio_callback(float* buffer, int num_frames, int num_channels)
+{
+	player_callback(sokol_player, (uint8_t *)buffer, num_frames * num_channels * sizeof(float));
+}
+#endif
+
+#ifdef AUDIO_DRIVER_MINIAL
+mal_uint32 minial_audio_callback(mal_device* pDevice, mal_uint32 frameCount, void* pSamples)
+{
+	struct player *player = pDevice->pUserData;
+
+	player_callback(player, (uint8_t *)pSamples, frameCount * audio_frame_size(&player->gbs->audio));
+	return frameCount;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	struct minigbs *gbs;
+	struct player player;
+	enum minigbs_error err;
+	unsigned int song_no;
+	const char *out_path = NULL;
+	float seconds = 0;
+	bool stems = false;
+	enum audio_format fmt = AUDIO_FORMAT_F32;
+	unsigned int channels = 2;
+	bool dither = false;
+	const char *batch_path = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool segmented = false;
+	bool two_phase = false;
+	bool pipelined = false;
+	int procs = 0;
+	float start = 0;
+	const char *index_path = NULL;
+	struct seek_index idx;
+	struct seek_index *index = NULL;
+	const char *vgm_path = NULL;
+	const char *log_path = NULL;
+	bool memoize = false;
+	int loops = -1;
+	float fade = 0;
+	float silence = 0;
+	struct reglog replay;
+	int status = EXIT_SUCCESS;
+	int opt;
+
+	while ((opt = getopt(argc, argv,
+			     "o:t:sf:mdb:j:cP:S:k:Tv:L:MN:F:E:")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch_path = optarg;
+			break;
+
+		case 'j':
+			threads	  = atoi(optarg);
+			segmented = true;
+			break;
+
+		case 'c':
+			two_phase = true;
+			break;
+
+		case 'T':
+			pipelined = true;
+			break;
+
+		case 'v':
+			vgm_path = optarg;
+			break;
+
+		case 'L':
+			log_path = optarg;
+			break;
+
+		case 'M':
+			memoize = true;
+			break;
+
+		case 'N':
+			loops = atoi(optarg);
+			break;
+
+		case 'F':
+			fade = atof(optarg);
+			break;
+
+		case 'E':
+			silence = atof(optarg);
+			break;
+
+		case 'P':
+			procs = atoi(optarg);
+			break;
+
+		case 'S':
+			start = atof(optarg);
+			break;
+
+		case 'k':
+			index_path = optarg;
+			break;
+
+		case 'o':
+			out_path = optarg;
+			break;
+
+		case 't':
+			seconds = atof(optarg);
+			break;
+
+		case 's':
+			stems = true;
+			break;
+
+		case 'f':
+			if (strcmp(optarg, "s16") == 0)
+				fmt = AUDIO_FORMAT_S16;
+			else if (strcmp(optarg, "f32") == 0)
+				fmt = AUDIO_FORMAT_F32;
+			else
+				goto usage;
+			break;
+
+		case 'm':
+			channels = 1;
+			break;
+
+		case 'd':
+			dither = true;
+			break;
+
+		default:
+			goto usage;
+		}
+	}
+
+	if (batch_path != NULL ? argc != optind :
+				 argc - optind != 1 && argc - optind != 2) {
+usage:
+		fprintf(stderr,
+			"Usage: %s [-o out.wav|- [-t seconds] [-s|-j threads] "
+			"[-N loops]\n"
+			"       [-F fade]] [-S start] [-k index] [-E silence] "
+			"[-f s16|f32] [-m]\n"
+			"       [-d] [-T] [-v out.vgm] [-M] file [song index]\n"
+			"       %s -L out.log [-t seconds] [-M] file "
+			"[song index]\n"
+			"       %s -b jobs [-j threads | -P processes] "
+			"[-E silence] [-f s16|f32]\n"
+			"       [-m] [-d]\n"
+			"  -o  Render to a WAV file instead of playing, or "
+			"stream raw\n"
+			"      samples to stdout with -\n"
+			"  -t  Length of the rendered file in seconds; streams "
+			"run\n"
+			"      until stdout is closed by default\n"
+			"  -s  Also write each channel to its own WAV file\n"
+			"  -S  Start at this many seconds into the song\n"
+			"  -k  Seek index file to resume from, extended while "
+			"rendering or\n"
+			"      playing, except with -j, -c or -T\n"
+			"  -N  Find where the song loops and print it; with "
+			"-o, render\n"
+			"      the intro and this many loops instead of -t\n"
+			"  -F  With -o, add this many seconds faded out to "
+			"silence\n"
+			"  -E  End songs that stay silent for this many "
+			"seconds after\n"
+			"      sounding: -o and -b renders stop where the "
+			"silence starts,\n"
+			"      and playback moves on to the next song\n"
+			"  -f  Output sample format, f32 by default\n"
+			"  -m  Mono output\n"
+			"  -d  Dither 16-bit output\n"
+			"  -T  Run the CPU on its own thread, ahead of "
+			"synthesis; disables\n"
+			"      rewind\n"
+			"  -v  Also write every audio register write to a VGM "
+			"file\n"
+			"  -L  Write a register log of the song instead of "
+			"playing,\n"
+			"      running only the CPU; logs and VGM files play "
+			"in place\n"
+			"      of a GBS file without the CPU\n"
+			"  -M  Replay cached play calls that start from a "
+			"state seen\n"
+			"      before instead of running the CPU\n"
+			"  -b  Render each line of a job list: file, song "
+			"index,\n"
+			"      seconds and output WAV file, separated by tabs\n"
+			"  -j  Number of threads for -b, one per core by "
+			"default; with\n"
+			"      -o, render segments of the song on this many "
+			"threads\n"
+			"  -c  With -o, run the CPU first, then render each "
+			"channel on\n"
+			"      its own thread\n"
+			"  -P  Render -b jobs in worker processes instead, "
+			"restarting\n"
+			"      crashed workers, and print a report of all "
+			"jobs\n",
+			argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (batch_path != NULL) {
+		const struct render_opts opts = {
+			.fmt = fmt, .channels = channels, .dither = dither,
+			.silence = silence
+		};
+		struct render_job *jobs;
+		struct timespec start, end;
+		double elapsed, seconds_total = 0;
+		int njobs, failed;
+
+		if ((njobs = render_jobs_load(batch_path, &jobs)) < 0) {
+			fprintf(stderr, "Error reading %s: %s\n", batch_path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < njobs; ++i)
+			seconds_total += jobs[i].seconds;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (procs > 0)
+			failed = render_sharded(jobs, njobs, procs, &opts,
+						stdout);
+		else
+			failed = render_batch(jobs, njobs,
+					      threads > 0 ? threads : 1, &opts);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		render_jobs_free(jobs, njobs);
+
+		if (failed < 0) {
+			fprintf(stderr, "Error starting workers: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		elapsed = (end.tv_sec - start.tv_sec) +
+			  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		fprintf(stderr, "Rendered %d of %d jobs, %.1f s in %.3f s "
+				"(%.1fx realtime).\n",
+			njobs - failed, njobs, seconds_total, elapsed,
+			elapsed > 0 ? seconds_total / elapsed : 0);
+
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if ((gbs = minigbs_create()) == NULL) {
+		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	reglog_init(&replay);
+	if ((err = minigbs_load(gbs, argv[optind])) == MINIGBS_ERR_NOT_GBS &&
+	    replay_load(gbs, &replay, argv[optind]) == 0)
+		err = MINIGBS_OK;
+
+	if (err != MINIGBS_OK) {
+		fprintf(stderr, "Error loading %s: %s.\n", argv[optind],
+			minigbs_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Get user selected song number to begin playing. */
+	song_no = gbs->regs.a;
+	if (argc - optind > 1)
+		song_no = atoi(argv[optind + 1]);
+
+	/* Check that user selected song number is within range of the number of
+	 * songs available in input GBS file. */
+	if (minigbs_song(gbs, song_no) != MINIGBS_OK) {
+		fprintf(stderr,
+			"Error: The selected song index of %d is out of range. "
+			"This file has %d songs.\n",
+			song_no, gbs->h.song_count - 1U);
+		exit(EXIT_FAILURE);
+	}
+
+	seek_index_init(&idx, song_no, SEEK_INTERVAL_SECONDS);
+
+#if defined(AUDIO_DRIVER_SOKOL)
+	/* Sokol only accepts floating point samples. */
+	if (out_path == NULL)
+		fmt = AUDIO_FORMAT_F32;
+#endif
+
+	audio_set_output(&gbs->audio, fmt, channels, dither);
+
+	if (memoize && (gbs->memo = memo_create()) == NULL) {
+		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	if (log_path != NULL) {
+		struct reglog log;
+		int ret;
+
+		if (seconds <= 0)
+			seconds = RENDER_DEFAULT_SECONDS;
+
+		reglog_init(&log);
+		ret = reglog_record(gbs, &log, seconds * AUDIO_SAMPLE_RATE);
+		if (ret == 0)
+			ret = reglog_save(&log, &gbs->h, log_path);
+		else
+			errno = ENOMEM;
+
+		reglog_free(&log);
+
+		if (ret != 0) {
+			fprintf(stderr, "Error writing %s: %s\n", log_path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		goto free;
+	}
+
+	/* The index is extended while rendering or playing, and written once
+	 * done. */
+	if (start > 0 || index_path != NULL) {
+		if (index_path != NULL) {
+			index = &idx;
+
+			if (seek_index_read(&idx, gbs, index_path) != 0 &&
+			    errno != ENOENT)
+				fprintf(stderr, "Ignoring seek index %s: %s\n",
+					index_path, strerror(errno));
+		}
+
+		if (seek_to(gbs, &idx, start * AUDIO_SAMPLE_RATE) != 0) {
+			fprintf(stderr, "Error seeking: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (loops >= 0) {
+		struct loop_info loop;
+		int ret;
+
+		ret = loop_find(gbs, LOOP_SEARCH_SECONDS * AUDIO_SAMPLE_RATE,
+				&loop);
+		if (ret < 0) {
+			fprintf(stderr, "Error: malloc failure at %d.\n",
+				__LINE__);
+			exit(EXIT_FAILURE);
+		}
+
+		if (ret > 0) {
+			fprintf(stderr,
+				"Intro: %lu calls, %lu samples (%.2f s); "
+				"loop: %lu calls, %lu samples (%.2f s).\n",
+				(unsigned long)loop.intro_calls,
+				(unsigned long)loop.intro_frames,
+				loop.intro_frames / (float)AUDIO_SAMPLE_RATE,
+				(unsigned long)loop.loop_calls,
+				(unsigned long)loop.loop_frames,
+				loop.loop_frames / (float)AUDIO_SAMPLE_RATE);
+			seconds = (loop.intro_frames +
+				   loops * loop.loop_frames) /
+				  (float)AUDIO_SAMPLE_RATE;
+		} else {
+			fprintf(stderr, "No loop found in the first %d s.\n",
+				LOOP_SEARCH_SECONDS);
+		}
+
+		if (out_path == NULL)
+			goto free;
+	}
+
+	if (silence > 0 && out_path != NULL) {
+		const float limit = seconds > 0 ? seconds :
+						  RENDER_DEFAULT_SECONDS;
+		uint64_t end;
+		int ret;
+
+		ret = silence_find(gbs, silence * AUDIO_SAMPLE_RATE,
+				   limit * AUDIO_SAMPLE_RATE, &end);
+		if (ret < 0) {
+			fprintf(stderr, "Error: malloc failure at %d.\n",
+				__LINE__);
+			exit(EXIT_FAILURE);
+		}
+
+		if (ret > 0) {
+			seconds = end / AUDIO_SAMPLE_RATE;
+			fprintf(stderr, "Song ends after %.2f s.\n", seconds);
+		}
+	}
+
+	if (vgm_path != NULL) {
+		/* Both render on copies of the instance. */
+		if (out_path != NULL && (segmented || two_phase)) {
+			fprintf(stderr, "Error: -v cannot be combined with -j "
+					"or -c.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if ((gbs->vgm = vgm_open(vgm_path, &gbs->audio)) == NULL) {
+			fprintf(stderr, "Error writing %s: %s\n", vgm_path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (out_path != NULL && strcmp(out_path, "-") == 0) {
+		/* Stems need files of their own, and a stream cannot be faded
+		 * once written. */
+		if (stems || fade > 0) {
+			fprintf(stderr, "Error: -o - cannot be combined with "
+					"-s or -F.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (render_raw(gbs, STDOUT_FILENO, seconds, index) != 0) {
+			fprintf(stderr, "Error writing to stdout: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		goto free;
+	}
+
+	if (out_path != NULL) {
+		struct timespec start, end;
+		double elapsed;
+		int ret;
+
+		if (seconds <= 0)
+			seconds = RENDER_DEFAULT_SECONDS;
+		if (fade > 0)
+			seconds += fade;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (two_phase && !stems)
+			ret = render_two_phase(gbs, out_path, seconds, fmt,
+					       channels);
+		else if (segmented && !stems)
+			ret = render_segmented(gbs, out_path, seconds, fmt,
+					       channels, threads);
+		else if (pipelined && !stems)
+			ret = render_pipelined(gbs, out_path, seconds, fmt,
+					       channels);
+		else
+			ret = render_wav(gbs, out_path, seconds, stems, fmt,
+					 channels, index);
+		if (ret == 0 && fade > 0)
+			ret = render_fade(out_path, stems, fade);
+
+		if (ret != 0) {
+			fprintf(stderr, "Error writing %s: %s\n", out_path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - start.tv_sec) +
+			  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		fprintf(stderr, "Rendered %.1f s in %.3f s (%.1fx realtime).\n",
+			seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0);
+
+		goto free;
+	}
+
+	player.gbs	     = gbs;
+	player.audio	     = &gbs->audio;
+	player.pipe	     = NULL;
+	player.rewind_frames = 0;
+	player.song_request  = -1;
+	player.song	     = song_no;
+	player.end_frames    = silence * AUDIO_SAMPLE_RATE;
+	player.played	     = 0;
+	player.idx	     = pipelined ? NULL : index;
+	player.indexing	     = player.idx != NULL;
+
+	/* The pipelined player keeps no rewind history. */
+	if (pipelined) {
+		if ((player.pipe = pipeline_start(gbs)) == NULL) {
+			fprintf(stderr, "Error starting CPU thread: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		player.audio = pipeline_audio(player.pipe);
+	} else if (rewind_init(&player.rw, REWIND_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: unable to allocate rewind history.\n");
+		exit(EXIT_FAILURE);
+	}
+
+#if defined(AUDIO_DRIVER_SDL)
+	/* Initialise SDL audio. */
+	{
+		SDL_AudioDeviceID audio;
+		SDL_AudioSpec     got;
+		SDL_AudioSpec     want = {
+			    .freq     = AUDIO_SAMPLE_RATE,
+			    .channels = channels,
+			    .samples  = AUDIO_SAMPLE_RATE / 12U,
+			    .format   = fmt == AUDIO_FORMAT_S16 ? AUDIO_S16SYS :
+							      AUDIO_F32SYS,
+			    .callback = player_callback,
+			    .userdata = &player,
+		};
+
+		if (SDL_Init(SDL_INIT_AUDIO) != 0) {
+			fprintf(stderr, "Error: SDL_Init failure: %s\n",
+				SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+
+		if ((audio = SDL_OpenAudioDevice(NULL, 0, &want, &got, 0)) == 0)
+		{
+			fprintf(stderr, "Error: SDL_OpenAudioDevice failure: "
+					"%s.\n",
+					SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+
+		/* Begin playing audio. */
+		SDL_PauseAudioDevice(audio, 0);
+	}
+#elif defined(AUDIO_DRIVER_SOKOL)
+	/* Initialise SOKOL Audio. */
+	{
+		const saudio_desc sd = {
+			.stream_cb = sokol_audio_callback,
+			.sample_rate = AUDIO_SAMPLE_RATE,
+			.num_channels = channels
+
+		};
+
+		sokol_player = &player;
+		saudio_setup(&sd);
+	}
+#elif defined(AUDIO_DRIVER_MINIAL)
+	mal_device device;
+	mal_context audio_ctx;
+	mal_device_config config;
+
+	{
+		if(mal_context_init(NULL, 0, NULL, &audio_ctx) != MAL_SUCCESS){
+			fprintf(stderr, "mal_context_init failed.\n");
+			exit(1);
+		}
+
+		config = mal_device_config_init_playback(
+				fmt == AUDIO_FORMAT_S16 ? mal_format_s16 :
+							  mal_format_f32,
+				channels, AUDIO_SAMPLE_RATE,
+				minial_audio_callback
+		);
+
+		if (mal_device_init(NULL, mal_device_type_playback, NULL, &config, &player, &device) != MAL_SUCCESS) {
+			printf("Failed to open playback device.\n");
+			return -3;
+		}
+
+		if (mal_device_start(&device) != MAL_SUCCESS) {
+			printf("Failed to start playback device.\n");
+			mal_device_uninit(&device);
+			return -4;
+		}
+	}
+#elif defined(AUDIO_DRIVER_NONE)
+	float *samples = malloc(AUDIO_SAMPLE_RATE * sizeof(float));
+#else
+#error "No audio driver defined."
+#endif
+
+	/* Fixes printf's not printing to stdout until exit in Windows. */
+	setbuf(stdout, NULL);
+
+	fprintf(stdout, "Keys: q = Quit, n = Next, p = Previous, "
+			"1-4 = Mute channel, 5-8 = Solo channel, "
+			"0 = Unmute all, r = Rewind\n");
+
+	while (1) {
+		int key;
+
+		switch ((key = getchar())) {
+		case 'q':
+			goto out;
+
+		case '1' ... '4':
+			audio_mute(player.audio, key - '1',
+				   !audio_muted(player.audio, key - '1'));
+			print_channels(player.audio);
+			break;
+
+		case '5' ... '8':
+			audio_solo(player.audio, key - '5');
+			print_channels(player.audio);
+			break;
+
+		case '0':
+			for (unsigned int i = 0; i < 4; ++i)
+				audio_mute(player.audio, i, false);
+
+			print_channels(player.audio);
+			break;
+
+		case 'r':
+			__atomic_store_n(&player.rewind_frames,
+					 (unsigned int)(REWIND_STEP_SECONDS *
+							AUDIO_SAMPLE_RATE),
+					 __ATOMIC_RELEASE);
+			break;
+
+		case 'n':
+			song_no = __atomic_load_n(&player.song,
+						  __ATOMIC_RELAXED);
+			if (song_no < gbs->h.song_count - 1U) {
+				player_song(&player, ++song_no);
+				fprintf(stdout, "Song %d of %d\n", song_no,
+					gbs->h.song_count - 1U);
+			}
+			break;
+
+		case 'p':
+			song_no = __atomic_load_n(&player.song,
+						  __ATOMIC_RELAXED);
+			if (song_no > 0) {
+				player_song(&player, --song_no);
+				fprintf(stdout, "Song %d of %d\n", song_no,
+					gbs->h.song_count - 1U);
+			}
+			break;
+		}
+#if defined(AUDIO_DRIVER_NONE)
+		player_callback(&player, (uint8_t *)samples,
+				AUDIO_SAMPLE_RATE * sizeof(float));
+#endif
+	}
+
+out:
+#if defined(AUDIO_DRIVER_SDL)
+	SDL_Quit();
+#elif defined(AUDIO_DRIVER_SOKOL)
+	saudio_shutdown();
+#elif defined(AUDIO_DRIVER_MINIAL)
+	mal_device_uninit(&device);
+#elif defined(AUDIO_DRIVER_NONE)
+	free(samples);
+#endif
+	if (player.pipe != NULL)
+		pipeline_stop(player.pipe);
+	else
+		rewind_free(&player.rw);
+
+free:
+	if (index != NULL && seek_index_write(index, gbs, index_path) != 0)
+		fprintf(stderr, "Error writing %s: %s\n", index_path,
+			strerror(errno));
+
+	seek_index_free(&idx);
+
+	if (gbs->vgm != NULL && vgm_close(gbs->vgm) != 0) {
+		fprintf(stderr, "Error writing %s: %s\n", vgm_path,
+			strerror(errno));
+		status = EXIT_FAILURE;
+	}
+
+	if (gbs->memo != NULL) {
+		const struct memo *m = gbs->memo;
+
+		fprintf(stderr, "Cached calls: %lu hits, %lu misses, %lu "
+				"checked, %lu mismatched.\n",
+			(unsigned long)m->hits, (unsigned long)m->misses,
+			(unsigned long)m->verified,
+			(unsigned long)m->mismatches);
+		memo_destroy(gbs->memo);
+	}
+
+	minigbs_destroy(gbs);
+	reglog_free(&replay);
+
+	return status;
+}
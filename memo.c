@@ -0,0 +1,190 @@
+#include "memo.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMO_MULT	0x9E3779B97F4A7C15ULL
+
+uint64_t memo_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	/* Four independent lanes, so that multiplies overlap. */
+	if (len >= 32) {
+		uint64_t lanes[4] = { h, h + 1, h + 2, h + 3 };
+
+		for (; len >= 32; len -= 32, p += 32) {
+			for (unsigned int i = 0; i < 4; ++i) {
+				uint64_t w;
+
+				memcpy(&w, p + i * 8, sizeof(w));
+				lanes[i] = (lanes[i] ^ w) * MEMO_MULT;
+				lanes[i] ^= lanes[i] >> 29;
+			}
+		}
+
+		for (unsigned int i = 0; i < 4; ++i)
+			h = (h ^ lanes[i]) * MEMO_MULT;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * MEMO_MULT;
+		h ^= h >> 29;
+	}
+
+	for (; len > 0; --len, ++p)
+		h = (h ^ *p) * MEMO_MULT;
+
+	return h;
+}
+
+uint64_t memo_key(struct memo_state *s, const struct minigbs *gbs)
+{
+	uint64_t h = 0;
+
+	for (uint64_t d = s->dirty; d != 0; d &= d - 1) {
+		const unsigned int i = __builtin_ctzll(d);
+
+		s->pages[i] = memo_hash(i, gbs->mem + i * RAM_PAGE_SIZE,
+					RAM_PAGE_SIZE);
+	}
+
+	s->dirty = 0;
+
+	h = memo_hash(h, &gbs->regs, sizeof(gbs->regs));
+	/* The bank mapped in can differ from the last one written to the
+	 * bank register, since writes of missing banks are ignored. */
+	h = memo_hash(h, &gbs->rom_bank, sizeof(gbs->rom_bank));
+	h = memo_hash(h, &gbs->selected_bank, sizeof(gbs->selected_bank));
+	h = memo_hash(h, s->pages, sizeof(s->pages));
+	h = memo_hash(h, gbs->hram, sizeof(gbs->hram));
+	h = memo_hash(h, gbs->audio.mem, sizeof(gbs->audio.mem));
+
+	/* 0 is kept for empty slots. */
+	return h != 0 ? h : 1;
+}
+
+void memo_clear(struct memo *m)
+{
+	memset(m->entries, 0, MEMO_SLOTS * sizeof(*m->entries));
+	m->used	   = 0;
+	m->nwrites = 0;
+
+	/* RAM may have been replaced without going through writes. */
+	m->state.dirty = ~0ULL;
+}
+
+struct memo *memo_create(void)
+{
+	struct memo *m;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return NULL;
+
+	m->state.dirty = ~0ULL;
+
+	m->entries = calloc(MEMO_SLOTS, sizeof(*m->entries));
+	m->writes  = malloc(MEMO_WRITES * sizeof(*m->writes));
+	if (m->entries == NULL || m->writes == NULL) {
+		memo_destroy(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void memo_destroy(struct memo *m)
+{
+	if (m == NULL)
+		return;
+
+	free(m->entries);
+	free(m->writes);
+	free(m);
+}
+
+/**
+ * Slot holding "key", or the empty slot where it would go.
+ */
+static struct memo_entry *memo_slot(struct memo *m, const uint64_t key)
+{
+	size_t i = key & (MEMO_SLOTS - 1);
+
+	/* Never full, so an empty slot always ends the search. */
+	while (m->entries[i].key != 0 && m->entries[i].key != key)
+		i = (i + 1) & (MEMO_SLOTS - 1);
+
+	return &m->entries[i];
+}
+
+const struct memo_entry *memo_begin(struct memo *m,
+				    const struct minigbs *gbs)
+{
+	struct memo_entry *e;
+
+	m->key = memo_key(&m->state, gbs);
+	e      = memo_slot(m, m->key);
+
+	if (e->key != 0) {
+		if (++m->hits % MEMO_VERIFY_INTERVAL != 0)
+			return e;
+
+		m->verify = e;
+	} else {
+		m->misses++;
+		m->verify = NULL;
+	}
+
+	m->recording = true;
+	m->overflow  = false;
+	m->start     = m->nwrites;
+	return NULL;
+}
+
+void memo_end(struct memo *m, const struct cpu_regs *regs)
+{
+	const size_t	   n = m->nwrites - m->start;
+	struct memo_entry *e = m->verify;
+
+	m->recording = false;
+
+	/* Calls that do not fit in what is left make room for later ones. */
+	if (m->overflow) {
+		memo_clear(m);
+		return;
+	}
+
+	if (e != NULL) {
+		m->verified++;
+
+		/* The real call wins; the writes of the old one are only
+		 * reclaimed when the cache is emptied. */
+		if (e->nwrites != n ||
+		    memcmp(&e->regs, regs, sizeof(*regs)) != 0 ||
+		    memcmp(m->writes + e->first, m->writes + m->start,
+			   n * sizeof(*m->writes)) != 0) {
+			m->mismatches++;
+			e->first   = m->start;
+			e->nwrites = n;
+			e->regs	   = *regs;
+			return;
+		}
+
+		m->nwrites = m->start;
+		return;
+	}
+
+	if (m->used + 1 > MEMO_SLOTS / 4 * 3) {
+		memo_clear(m);
+		return;
+	}
+
+	e	   = memo_slot(m, m->key);
+	e->key	   = m->key;
+	e->first   = m->start;
+	e->nwrites = n;
+	e->regs	   = *regs;
+	m->used++;
+}
@@ -0,0 +1,145 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/* Play calls held, a power of two; the cache is emptied when it is three
+ * quarters full. Several minutes of calls fit before that happens. */
+#define MEMO_SLOTS		(1 << 15)
+
+/* Memory writes held for all calls together. */
+#define MEMO_WRITES		(1 << 20)
+
+/* Every this many hits, the call is run anyway and checked against the
+ * cache. */
+#define MEMO_VERIFY_INTERVAL	16
+
+/**
+ * One write made by a cached call, to any address.
+ */
+struct memo_write {
+	uint16_t addr;
+	uint8_t	 val;
+} __attribute__((packed));
+
+/**
+ * A cached call: the key of the state it started from, the writes it made, in
+ * order, and the CPU registers it returned with.
+ */
+struct memo_entry {
+	uint64_t	key;
+	uint32_t	first;
+	uint32_t	nwrites;
+	struct cpu_regs regs;
+};
+
+/**
+ * Hash of everything a call can read apart from the ROM, which only the
+ * selected bank picks from: the CPU registers, the bank mapped in and the one
+ * last written to the bank register, RAM, HRAM and audio registers.
+ * RAM is hashed by page, and only pages marked in "dirty" are hashed again.
+ */
+struct memo_state {
+	uint64_t pages[RAM_SIZE / RAM_PAGE_SIZE];
+	uint64_t dirty;
+};
+
+/**
+ * Cache of init and play calls of one instance. The play routine can read
+ * only the ROM, RAM, HRAM, audio registers and CPU registers, and change the
+ * state only through its writes and the CPU registers, so a call starting
+ * from a state with the same hash as a cached one is replaced by the writes
+ * and registers of the cached call. Hits are checked against real calls
+ * every MEMO_VERIFY_INTERVAL hits, to catch hash collisions.
+ */
+struct memo {
+	/* Its "dirty" pages are marked by writes to RAM. */
+	struct memo_state state;
+
+	struct memo_entry *entries;
+	size_t		   used;
+	struct memo_write *writes;
+	size_t		   nwrites;
+
+	/* Call being recorded since write "start", with the key it started
+	 * from, and the entry it is checked against if it was a hit. */
+	bool		   recording;
+	bool		   overflow;
+	size_t		   start;
+	uint64_t	   key;
+	struct memo_entry *verify;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t verified;
+	uint64_t mismatches;
+};
+
+/**
+ * Hash "len" bytes of "data", continuing from the hash "h". Fast, but not
+ * meant to resist crafted input.
+ */
+uint64_t memo_hash(uint64_t h, const void *data, size_t len);
+
+/**
+ * Key of the state of "gbs" in "s", which is never 0. All pages must be marked
+ * dirty for the first key, and the marks are cleared.
+ */
+uint64_t memo_key(struct memo_state *s, const struct minigbs *gbs);
+
+/**
+ * Allocate an empty cache.
+ * \return	Cache, or NULL if memory could not be allocated.
+ */
+struct memo *memo_create(void);
+
+/**
+ * Free "m" and all memory it holds.
+ */
+void memo_destroy(struct memo *m);
+
+/**
+ * Drop every cached call. Keys do not cover the ROM, so this is done whenever
+ * another file is loaded. RAM is hashed again in full.
+ */
+void memo_clear(struct memo *m);
+
+/**
+ * Look up the call "gbs" is about to make.
+ * \return	The cached call to apply instead of running the CPU, or NULL if
+ *		the call must be run, in which case it is recorded until
+ *		memo_end().
+ */
+const struct memo_entry *memo_begin(struct memo *m,
+				    const struct minigbs *gbs);
+
+/**
+ * Add a write made by the CPU to the call being recorded, if any.
+ */
+static inline void memo_record(struct memo *m, const uint16_t addr,
+			       const uint8_t val)
+{
+	if (!m->recording)
+		return;
+
+	if (m->nwrites == MEMO_WRITES) {
+		m->overflow = true;
+		return;
+	}
+
+	m->writes[m->nwrites].addr = addr;
+	m->writes[m->nwrites].val  = val;
+	m->nwrites++;
+}
+
+/**
+ * Finish recording a call that returned with the CPU registers "regs", and
+ * cache it or check it against the cached call.
+ */
+void memo_end(struct memo *m, const struct cpu_regs *regs);
+
+#endif
@@ -1,31 +1,26 @@
 #include "minigbs.h"
 #include "audio.h"
+#include "bank_cache.h"
+#include "memo.h"
+#include "reglog.h"
+#include "vgm.h"
+#include "util.h"
 #include <errno.h>
-#include <math.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#ifdef AUDIO_DRIVER_SDL
-#include <SDL2/SDL.h>
-#endif
-
-#ifdef AUDIO_DRIVER_SOKOL
-#define SOKOL_IMPL
-#include "sokol_audio.h"
-#endif
-
-#ifdef AUDIO_DRIVER_MINIAL
-#define MINI_AL_IMPLEMENTATION
-#include "mini_al.h"
-#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 #error "Some of the bitfield / casting used in here assumes little endian :("
 #endif
 
-#define ROM_BANK_SIZE	0x4000
 #define ROM_BANK1_ADDR	0x4000
 #define VRAM_ADDR	0x8000
 #define RAM_START_ADDR	0xA000
@@ -33,120 +28,120 @@
 #define HRAM_START_ADDR	0xFF80
 #define HRAM_STOP_ADDR	0xFFFE
 
-struct GBSHeader {
-	char     id[3];
-	uint8_t  version;
-	uint8_t  song_count;
-	uint8_t  start_song;
-	uint16_t load_addr;
-	uint16_t init_addr;
-	uint16_t play_addr;
-	uint16_t sp;
-	uint8_t  tma;
-	uint8_t  tac;
-	char     title[32];
-	char     author[32];
-	char     copyright[32];
-} __attribute__((packed)) GBSHeader;
-
-struct {
-	union {
-		uint16_t af;
-		struct {
-			union {
-				struct {
-					uint8_t _pad : 4, c : 1, h : 1, n : 1,
-						z : 1;
-				};
-				uint8_t all;
-			} flags;
-			uint8_t a;
-		};
-	};
-	union {
-		uint16_t bc;
-		struct {
-			uint8_t c, b;
-		};
-	};
-	union {
-		uint16_t de;
-		struct {
-			uint8_t e, d;
-		};
-	};
-	union {
-		uint16_t hl;
-		struct {
-			uint8_t l, h;
-		};
-	};
-	uint16_t sp, pc;
-} regs;
+/* Offset of the data loaded to load_addr in a GBS file. */
+#define GBS_DATA_OFFSET	0x70
 
-#define MAX(a, b) ({ a > b ? a : b; })
+/**
+ * Address of ROM bank "which", or NULL if the file holds no data for it. Only
+ * bank 0 and the partially filled banks at either end of the data have their
+ * own copy; every other bank is computed from its place in the mapping.
+ */
+static const uint8_t *bank_get(const struct minigbs_rom *rom,
+			       const unsigned int which)
+{
+	if (which == 0)
+		return rom->bank0;
+
+	if (which < rom->bank_first || which > rom->bank_last)
+		return NULL;
 
-uint8_t *mem;
-uint8_t *hram;
+	if (which == rom->bank_first && rom->bank_head != NULL)
+		return rom->bank_head;
 
-static struct GBSHeader h;
-static uint8_t *	banks[32];
-static uint8_t *	selected_rom_bank;
+	if (which == rom->bank_last && rom->bank_tail != NULL)
+		return rom->bank_tail;
 
-static void bank_switch(const uint8_t which)
+	return rom->map + GBS_DATA_OFFSET +
+	       (which * ROM_BANK_SIZE - rom->load_addr);
+}
+
+static void bank_switch(struct minigbs *gbs, const unsigned int which)
 {
+	const uint8_t *bank = bank_get(gbs->rom, which);
+
 	// allowing bank switch to 0 seems to break some games
-	if (which > 0 && which < 32 && banks[which])
-		selected_rom_bank = banks[which];
+	if (which > 0 && bank != NULL) {
+		gbs->selected_rom_bank = bank;
+		gbs->selected_bank     = which;
+	}
 }
 
-static void mem_write(const uint16_t addr, const uint8_t val)
+static void mem_write(struct minigbs *gbs, const uint16_t addr,
+		      const uint8_t val)
 {
+	if (gbs->memo != NULL)
+		memo_record(gbs->memo, addr, val);
+
 	/* Call audio_write when writing to audio registers. */
-	if (addr >= 0xFF06 && addr <= 0xFF3F)
-		audio_write(addr, val);
-	/* Switch ROM banks. */
-	else if (addr >= 0x2000 && addr < ROM_BANK1_ADDR)
-		bank_switch(val);
-	else if (addr >= RAM_START_ADDR && addr <= RAM_STOP_ADDR)
-		mem[addr - RAM_START_ADDR] = val;
+	if (addr >= 0xFF06 && addr <= 0xFF3F) {
+		audio_write(&gbs->audio, addr, val);
+
+		if (gbs->reglog != NULL)
+			reglog_write(gbs->reglog, addr, val);
+
+		if (gbs->vgm != NULL)
+			vgm_write(gbs->vgm, addr, val);
+	}
+	/* Switch ROM banks. Files of more than 256 banks take bit 8 of the bank
+	 * number from writes to 0x3000 to 0x3FFF, like MBC5. */
+	else if (addr >= 0x2000 && addr < ROM_BANK1_ADDR) {
+		if (gbs->rom->bank_last < 0x100)
+			gbs->rom_bank = val;
+		else if (addr < 0x3000)
+			gbs->rom_bank = (gbs->rom_bank & 0x100) | val;
+		else
+			gbs->rom_bank = (gbs->rom_bank & 0xFF) | (val & 1) << 8;
+
+		bank_switch(gbs, gbs->rom_bank);
+	}
+	else if (addr >= RAM_START_ADDR && addr <= RAM_STOP_ADDR) {
+		const uint64_t page = 1ULL << (addr - RAM_START_ADDR) /
+						 RAM_PAGE_SIZE;
+
+		gbs->mem[addr - RAM_START_ADDR] = val;
+		gbs->ram_dirty |= page;
+
+		if (gbs->memo != NULL)
+			gbs->memo->state.dirty |= page;
+	}
 	else if (addr >= HRAM_START_ADDR && addr <= HRAM_STOP_ADDR)
-		hram[addr - HRAM_START_ADDR] = val;
+		gbs->hram[addr - HRAM_START_ADDR] = val;
 
 	return;
 }
 
-static uint8_t mem_read(const uint16_t addr)
+static uint8_t mem_read(const struct minigbs *gbs, const uint16_t addr)
 {
 	/* Read from ROM Bank 0. */
 	if (addr < 0x4000)
-		return banks[0][addr];
+		return gbs->bank0[addr];
 	/* Read from selected ROM Bank 1. */
 	else if (addr >= 0x4000 && addr <= 0x7FFF)
-		return selected_rom_bank[addr - 0x4000];
+		return gbs->selected_rom_bank[addr - 0x4000];
 	else if (addr >= RAM_START_ADDR && addr <= RAM_STOP_ADDR)
-		return mem[addr - RAM_START_ADDR];
+		return gbs->mem[addr - RAM_START_ADDR];
 	/* Read Audio registers. */
 	else if (addr >= 0xFF06 && addr <= 0xFF3F)
-		return audio_read(addr);
+		return audio_read(&gbs->audio, addr);
 	else if (addr >= HRAM_START_ADDR && addr <= HRAM_STOP_ADDR)
-		return hram[addr - HRAM_START_ADDR];
+		return gbs->hram[addr - HRAM_START_ADDR];
 
 	/* Catch-all for everything else. */
 	return 0xFF;
 }
 
-static void cpu_step(void)
+static void cpu_step(struct minigbs *gbs)
 {
+	struct cpu_regs *const regs = &gbs->regs;
 	uint8_t		op;
 	uint_least16_t	x;
 	uint_least16_t	y;
 	uint_least16_t	z;
 
-	if (regs.pc >= ROM_BANK1_ADDR && regs.pc < VRAM_ADDR)
-		op = selected_rom_bank[regs.pc - ROM_BANK1_ADDR];
+	if (regs->pc >= ROM_BANK1_ADDR && regs->pc < VRAM_ADDR)
+		op = gbs->selected_rom_bank[regs->pc - ROM_BANK1_ADDR];
 	else
-		op = mem_read(regs.pc);
+		op = mem_read(gbs, regs->pc);
 
 	x = op >> 6;
 	y = (op >> 3) & 7;
@@ -196,13 +191,13 @@ static void cpu_step(void)
 	};
 
 	// TODO: clean this mess up
-	uint8_t *	r[]   = { &regs.b, &regs.c, &regs.d, &regs.e, &regs.h,
-				  &regs.l, mem - RAM_START_ADDR + regs.hl,
-			   	  &regs.a };
-	static uint16_t *rr[]  = { &regs.bc, &regs.de, &regs.hl, &regs.hl };
+	uint8_t *	r[]   = { &regs->b, &regs->c, &regs->d, &regs->e,
+				  &regs->h, &regs->l,
+				  gbs->mem - RAM_START_ADDR + regs->hl, &regs->a };
+	uint16_t *	rr[]  = { &regs->bc, &regs->de, &regs->hl, &regs->hl };
 	static void *    rot[] = { &&op_rlc, &&op_rrc, &&op_rl,   &&op_rr,
 				   &&op_sla, &&op_sra, &&op_swap, &&op_srl };
-	static uint16_t *rp2[] = { &regs.bc, &regs.de, &regs.hl, &regs.af };
+	uint16_t *	rp2[] = { &regs->bc, &regs->de, &regs->hl, &regs->af };
 
 	uint8_t alu_val = 0;
 
@@ -210,7 +205,7 @@ static void cpu_step(void)
 	({                                     \
 		uint8_t v;                     \
 		if (i == 6) {                  \
-			v = mem_read(regs.hl); \
+			v = mem_read(gbs, regs->hl); \
 		} else {                       \
 			v = *r[i];             \
 		}                              \
@@ -219,7 +214,7 @@ static void cpu_step(void)
 #define R_WRITE(i, v)                          \
 	({                                     \
 		if (i == 6) {                  \
-			mem_write(regs.hl, v); \
+			mem_write(gbs, regs->hl, v); \
 		} else {                       \
 			*r[i] = v;             \
 		};                             \
@@ -234,7 +229,7 @@ static void cpu_step(void)
 	} else if (zmap[x][z] > ALUY) {
 		goto *zmap[x][z];
 	} else if (zmap[x][z] == ALUY) {
-		alu_val = mem_read(++regs.pc);
+		alu_val = mem_read(gbs, ++regs->pc);
 		goto *alu[y];
 	} else {
 		goto *ymap[x][z][y];
@@ -247,14 +242,14 @@ static void cpu_step(void)
 	op_##name:              \
 	{                       \
 		code;           \
-		regs.pc += len; \
+		regs->pc += len; \
 		goto end;       \
 	}
-#define CHECKCC(n) (((regs.flags.all >> cc[n].shift) & 1) == cc[n].want)
+#define CHECKCC(n) (((regs->flags.all >> cc[n].shift) & 1) == cc[n].want)
 
-#define SS(p) (((uint16_t *)&regs.bc)[p])
-#define DD(p) (((uint16_t *)&regs.bc) + (p))
-#define NN ((((uint16_t)mem_read(regs.pc + 2)) << 8) | mem_read(regs.pc + 1))
+#define SS(p) (((uint16_t *)&regs->bc)[p])
+#define DD(p) (((uint16_t *)&regs->bc) + (p))
+#define NN ((((uint16_t)mem_read(gbs, regs->pc + 2)) << 8) | mem_read(gbs, regs->pc + 1))
 
 	OP(mov8, 1, {
 		if (z == 6 && y == 6) {
@@ -268,15 +263,15 @@ static void cpu_step(void)
 		size_t p = y >> 1;
 
 		if (y & 1) {
-			regs.a = mem_read(*rr[p]);
+			regs->a = mem_read(gbs, *rr[p]);
 		} else {
-			mem_write(*rr[p], regs.a);
+			mem_write(gbs, *rr[p], regs->a);
 		}
 
 		if (p == 2)
-			regs.hl++;
+			regs->hl++;
 		else if (p == 3)
-			regs.hl--;
+			regs->hl--;
 	});
 
 	OP(incdec16, 1, {
@@ -288,21 +283,21 @@ static void cpu_step(void)
 	});
 
 	OP(inc8, 1, {
-		regs.flags.h = (R_READ(y) & 0xF) == 9;
+		regs->flags.h = (R_READ(y) & 0xF) == 9;
 		R_WRITE(y, R_READ(y) + 1);
-		regs.flags.z = !R_READ(y);
-		regs.flags.n = 0;
+		regs->flags.z = !R_READ(y);
+		regs->flags.n = 0;
 	});
 
 	OP(dec8, 1, {
-		regs.flags.h = (R_READ(y) & 0xF) == 0;
+		regs->flags.h = (R_READ(y) & 0xF) == 0;
 		R_WRITE(y, R_READ(y) - 1);
-		regs.flags.z = !R_READ(y);
-		regs.flags.n = 1;
+		regs->flags.z = !R_READ(y);
+		regs->flags.n = 1;
 	});
 
 	OP(ld8, 2, {
-		R_WRITE(y, mem_read(regs.pc + 1));
+		R_WRITE(y, mem_read(gbs, regs->pc + 1));
 	});
 
 	OP(nop, 1,
@@ -311,8 +306,8 @@ static void cpu_step(void)
 	   });
 
 	OP(stsp, 3, {
-		mem_write(NN + 1, regs.sp >> 8);
-		mem_write(NN, regs.sp & 0xFF);
+		mem_write(gbs, NN + 1, regs->sp >> 8);
+		mem_write(gbs, NN, regs->sp & 0xFF);
 	});
 
 	OP(stop, 2,
@@ -320,11 +315,11 @@ static void cpu_step(void)
 		   // skip
 	   });
 
-	OP(jr, 2, { regs.pc += (int8_t)mem_read(regs.pc + 1); });
+	OP(jr, 2, { regs->pc += (int8_t)mem_read(gbs, regs->pc + 1); });
 
 	OP(jrcc, 2, {
 		if (CHECKCC(y - 4)) {
-			regs.pc += (int8_t)mem_read(regs.pc + 1);
+			regs->pc += (int8_t)mem_read(gbs, regs->pc + 1);
 		}
 	});
 
@@ -332,165 +327,165 @@ static void cpu_step(void)
 
 	OP(addhl, 1, {
 		uint16_t ss  = SS(y >> 1);
-		regs.flags.h = (((ss & 0x0FFF) + (regs.hl & 0x0FFF)) &
+		regs->flags.h = (((ss & 0x0FFF) + (regs->hl & 0x0FFF)) &
 				0x1000) == 0x1000;
-		regs.flags.c = __builtin_add_overflow(regs.hl, ss, &regs.hl);
-		regs.flags.n = 0;
+		regs->flags.c = __builtin_add_overflow(regs->hl, ss, &regs->hl);
+		regs->flags.n = 0;
 	});
 
 	OP(rlca, 1, {
-		regs.flags.c = regs.a >> 7;
-		regs.a       = (regs.a << 1) | regs.flags.c;
-		regs.flags.z = regs.flags.n = regs.flags.h = 0;
+		regs->flags.c = regs->a >> 7;
+		regs->a       = (regs->a << 1) | regs->flags.c;
+		regs->flags.z = regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rrca, 1, {
-		regs.flags.c = regs.a & 1;
-		regs.a       = (regs.a >> 1) | regs.flags.c << 7;
-		regs.flags.z = regs.flags.n = regs.flags.h = 0;
+		regs->flags.c = regs->a & 1;
+		regs->a       = (regs->a >> 1) | regs->flags.c << 7;
+		regs->flags.z = regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rla, 1, {
-		size_t newc  = regs.a >> 7;
-		regs.a       = (regs.a << 1) | regs.flags.c;
-		regs.flags.c = newc;
-		regs.flags.z = regs.flags.n = regs.flags.h = 0;
+		size_t newc  = regs->a >> 7;
+		regs->a       = (regs->a << 1) | regs->flags.c;
+		regs->flags.c = newc;
+		regs->flags.z = regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rra, 1, {
-		size_t newc  = regs.a & 1;
-		regs.a       = (regs.a >> 1) | regs.flags.c << 7;
-		regs.flags.c = newc;
-		regs.flags.z = regs.flags.n = regs.flags.h = 0;
+		size_t newc  = regs->a & 1;
+		regs->a       = (regs->a >> 1) | regs->flags.c << 7;
+		regs->flags.c = newc;
+		regs->flags.z = regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(daa, 1, {
-		size_t up   = regs.a >> 4;
-		size_t dn   = regs.a & 0xF;
+		size_t up   = regs->a >> 4;
+		size_t dn   = regs->a & 0xF;
 		size_t newc = 0;
 
-		if (dn >= 10 || regs.flags.h) {
-			if (regs.flags.n) {
-				newc |= __builtin_sub_overflow(regs.a, 0x06,
-							       &regs.a);
+		if (dn >= 10 || regs->flags.h) {
+			if (regs->flags.n) {
+				newc |= __builtin_sub_overflow(regs->a, 0x06,
+							       &regs->a);
 			} else {
-				newc |= __builtin_add_overflow(regs.a, 0x06,
-							       &regs.a);
+				newc |= __builtin_add_overflow(regs->a, 0x06,
+							       &regs->a);
 			}
 		}
 
-		if (up >= 10 || regs.flags.c) {
-			if (regs.flags.n) {
-				newc |= __builtin_sub_overflow(regs.a, 0x60,
-							       &regs.a);
+		if (up >= 10 || regs->flags.c) {
+			if (regs->flags.n) {
+				newc |= __builtin_sub_overflow(regs->a, 0x60,
+							       &regs->a);
 			} else {
-				newc |= __builtin_add_overflow(regs.a, 0x60,
-							       &regs.a);
+				newc |= __builtin_add_overflow(regs->a, 0x60,
+							       &regs->a);
 			}
 		}
 
-		regs.flags.c = newc;
-		regs.flags.h = 0;
-		regs.flags.z = !regs.a;
+		regs->flags.c = newc;
+		regs->flags.h = 0;
+		regs->flags.z = !regs->a;
 	});
 
 	OP(cpl, 1, {
-		regs.a       = ~regs.a;
-		regs.flags.h = 1;
-		regs.flags.n = 1;
+		regs->a       = ~regs->a;
+		regs->flags.h = 1;
+		regs->flags.n = 1;
 	});
 
 	OP(scf, 1, {
-		regs.flags.c = 1;
-		regs.flags.h = 0;
-		regs.flags.n = 0;
+		regs->flags.c = 1;
+		regs->flags.h = 0;
+		regs->flags.n = 0;
 	});
 
 	OP(ccf, 1, {
-		regs.flags.c = !regs.flags.c;
-		regs.flags.h = 0;
-		regs.flags.n = 0;
+		regs->flags.c = !regs->flags.c;
+		regs->flags.h = 0;
+		regs->flags.n = 0;
 	});
 
 	OP(retcc, 1, {
 		if (CHECKCC(y)) {
-			regs.pc = ((mem_read(regs.sp + 1) << 8) |
-				   mem_read(regs.sp)) -
+			regs->pc = ((mem_read(gbs, regs->sp + 1) << 8) |
+				   mem_read(gbs, regs->sp)) -
 				  1;
-			regs.sp += 2;
+			regs->sp += 2;
 		}
 	});
 
-	OP(sth, 2, { mem_write(0xFF00 + mem_read(regs.pc + 1), regs.a); });
+	OP(sth, 2, { mem_write(gbs, 0xFF00 + mem_read(gbs, regs->pc + 1), regs->a); });
 
 	OP(addsp, 2, {
-		regs.flags.h =
-			(((regs.sp & 0x0FFF) + (mem_read(regs.pc + 1) & 0x0F)) &
+		regs->flags.h =
+			(((regs->sp & 0x0FFF) + (mem_read(gbs, regs->pc + 1) & 0x0F)) &
 			 0x1000) == 0x1000;
-		regs.flags.c = __builtin_add_overflow(
-			regs.sp, (int8_t)mem_read(regs.pc + 1),
-			(int16_t *)&regs.sp);
-		regs.flags.z = regs.flags.n = 0;
+		regs->flags.c = __builtin_add_overflow(
+			regs->sp, (int8_t)mem_read(gbs, regs->pc + 1),
+			(int16_t *)&regs->sp);
+		regs->flags.z = regs->flags.n = 0;
 	});
 
-	OP(ldh, 2, { regs.a = mem_read(0xFF00 + mem_read(regs.pc + 1)); });
+	OP(ldh, 2, { regs->a = mem_read(gbs, 0xFF00 + mem_read(gbs, regs->pc + 1)); });
 
 	OP(ldsp, 2, {
-		regs.hl      = regs.sp + mem_read(regs.pc + 1);
-		regs.flags.h = regs.flags.n = regs.flags.z = regs.flags.c =
+		regs->hl      = regs->sp + mem_read(gbs, regs->pc + 1);
+		regs->flags.h = regs->flags.n = regs->flags.z = regs->flags.c =
 			0; // XXX: probably wrong
 	});
 
 	OP(pop, 1, {
-		*rp2[y >> 1] = (mem_read(regs.sp + 1) << 8) | mem_read(regs.sp);
-		regs.sp += 2;
+		*rp2[y >> 1] = (mem_read(gbs, regs->sp + 1) << 8) | mem_read(gbs, regs->sp);
+		regs->sp += 2;
 	});
 
 	OP(ret, 0, {
-		regs.pc = (mem_read(regs.sp + 1) << 8 | mem_read(regs.sp));
-		regs.sp += 2;
+		regs->pc = (mem_read(gbs, regs->sp + 1) << 8 | mem_read(gbs, regs->sp));
+		regs->sp += 2;
 	});
 
 	OP(reti, 0, {
-		regs.pc = mem_read(regs.sp + 1) << 8 | mem_read(regs.sp);
-		regs.sp += 2;
+		regs->pc = mem_read(gbs, regs->sp + 1) << 8 | mem_read(gbs, regs->sp);
+		regs->sp += 2;
 		// XXX: interrupts not implemented
 	});
 
-	OP(jphl, 0, { regs.pc = regs.hl; });
+	OP(jphl, 0, { regs->pc = regs->hl; });
 
-	OP(sphl, 1, { regs.sp = regs.hl; });
+	OP(sphl, 1, { regs->sp = regs->hl; });
 
 	OP(jpcc, 3, {
 		if (CHECKCC(y)) {
-			regs.pc = NN - 3;
+			regs->pc = NN - 3;
 		}
 	});
 
-	OP(stha, 1, { mem_write(0xFF00 + regs.c, regs.a); });
+	OP(stha, 1, { mem_write(gbs, 0xFF00 + regs->c, regs->a); });
 
-	OP(st16, 3, { mem_write(NN, regs.a); });
+	OP(st16, 3, { mem_write(gbs, NN, regs->a); });
 
-	OP(ldha, 1, { regs.a = mem_read(0xFF00 + regs.c); });
+	OP(ldha, 1, { regs->a = mem_read(gbs, 0xFF00 + regs->c); });
 
-	OP(lda16, 3, { regs.a = mem_read(NN); });
+	OP(lda16, 3, { regs->a = mem_read(gbs, NN); });
 
-	OP(jp, 0, { regs.pc = NN; });
+	OP(jp, 0, { regs->pc = NN; });
 
 	OP(cb, 0, {
-		op = mem_read(++regs.pc);
+		op = mem_read(gbs, ++regs->pc);
 		x  = (op >> 6);
 		y  = (op >> 3) & 7;
 		z  = op & 7;
 
-		++regs.pc;
+		++regs->pc;
 
 		if (x == 0) {
 			goto *rot[y];
 		} else if (x == 1) { // BIT
-			regs.flags.z = !(R_READ(z) & (1 << y));
-			regs.flags.n = 0;
-			regs.flags.h = 1;
+			regs->flags.z = !(R_READ(z) & (1 << y));
+			regs->flags.n = 0;
+			regs->flags.h = 1;
 		} else if (x == 2) { // RES
 			R_WRITE(z, R_READ(z) & ~(1 << y));
 		} else { // SET
@@ -515,436 +510,664 @@ static void cpu_step(void)
 
 	OP(callcc, 3, {
 		if (CHECKCC(y)) {
-			mem_write(regs.sp - 1, (regs.pc + 3) >> 8);
-			mem_write(regs.sp - 2, (regs.pc + 3) & 0xFF);
-			regs.sp -= 2;
-			regs.pc = NN - 3;
+			mem_write(gbs, regs->sp - 1, (regs->pc + 3) >> 8);
+			mem_write(gbs, regs->sp - 2, (regs->pc + 3) & 0xFF);
+			regs->sp -= 2;
+			regs->pc = NN - 3;
 		}
 	});
 
 	OP(push, 1, {
-		mem_write(regs.sp - 2, *rp2[y >> 1] & 0xFF);
-		mem_write(regs.sp - 1, *rp2[y >> 1] >> 8);
-		regs.sp -= 2;
+		mem_write(gbs, regs->sp - 2, *rp2[y >> 1] & 0xFF);
+		mem_write(gbs, regs->sp - 1, *rp2[y >> 1] >> 8);
+		regs->sp -= 2;
 	});
 
 	OP(call, 0, {
-		mem_write(regs.sp - 1, (regs.pc + 3) >> 8);
-		mem_write(regs.sp - 2, (regs.pc + 3) & 0xFF);
-		regs.sp -= 2;
-		regs.pc = NN;
+		mem_write(gbs, regs->sp - 1, (regs->pc + 3) >> 8);
+		mem_write(gbs, regs->sp - 2, (regs->pc + 3) & 0xFF);
+		regs->sp -= 2;
+		regs->pc = NN;
 	});
 
 	OP(rst, 0, {
-		mem_write(regs.sp - 1, (regs.pc + 1) >> 8);
-		mem_write(regs.sp - 2, (regs.pc + 1) & 0xFF);
-		regs.pc = h.load_addr + (y * 8);
-		regs.sp -= 2;
+		mem_write(gbs, regs->sp - 1, (regs->pc + 1) >> 8);
+		mem_write(gbs, regs->sp - 2, (regs->pc + 1) & 0xFF);
+		regs->pc = gbs->h.load_addr + (y * 8);
+		regs->sp -= 2;
 	});
 
 	OP(add, 1, {
-		regs.flags.h = (((regs.a & 0x0F) + (alu_val & 0x0F)) & 0x10) ==
+		regs->flags.h = (((regs->a & 0x0F) + (alu_val & 0x0F)) & 0x10) ==
 			       0x10;
-		regs.flags.c = __builtin_add_overflow(regs.a, alu_val, &regs.a);
-		regs.flags.z = regs.a == 0;
-		regs.flags.n = 0;
+		regs->flags.c = __builtin_add_overflow(regs->a, alu_val, &regs->a);
+		regs->flags.z = regs->a == 0;
+		regs->flags.n = 0;
 	});
 
 	OP(adc, 1, {
-		regs.flags.h =
-			(((regs.a & 0x0F) + (alu_val & 0x0F) + regs.flags.c) &
+		regs->flags.h =
+			(((regs->a & 0x0F) + (alu_val & 0x0F) + regs->flags.c) &
 			 0x10) == 0x10;
 		uint8_t tmp;
-		regs.flags.c =
-			__builtin_add_overflow(regs.a, regs.flags.c, &tmp) |
-			__builtin_add_overflow(tmp, alu_val, &regs.a);
-		regs.flags.z = regs.a == 0;
-		regs.flags.n = 0;
+		regs->flags.c =
+			__builtin_add_overflow(regs->a, regs->flags.c, &tmp) |
+			__builtin_add_overflow(tmp, alu_val, &regs->a);
+		regs->flags.z = regs->a == 0;
+		regs->flags.n = 0;
 	});
 
 	OP(sub, 1, {
-		regs.flags.h = (regs.a & 0x0F) < (alu_val & 0x0F);
-		regs.flags.c = __builtin_sub_overflow(regs.a, alu_val, &regs.a);
-		regs.flags.z = regs.a == 0;
-		regs.flags.n = 1;
+		regs->flags.h = (regs->a & 0x0F) < (alu_val & 0x0F);
+		regs->flags.c = __builtin_sub_overflow(regs->a, alu_val, &regs->a);
+		regs->flags.z = regs->a == 0;
+		regs->flags.n = 1;
 	});
 
 	OP(sbc, 1, {
-		regs.flags.h = (regs.a & 0x0F) < (alu_val & 0x0F) ||
-			       (regs.a & 0x0F) < regs.flags.c;
+		regs->flags.h = (regs->a & 0x0F) < (alu_val & 0x0F) ||
+			       (regs->a & 0x0F) < regs->flags.c;
 		uint8_t tmp;
-		regs.flags.c =
-			__builtin_sub_overflow(regs.a, regs.flags.c, &tmp) |
-			__builtin_sub_overflow(tmp, alu_val, &regs.a);
-		regs.flags.z = regs.a == 0;
-		regs.flags.n = 1;
+		regs->flags.c =
+			__builtin_sub_overflow(regs->a, regs->flags.c, &tmp) |
+			__builtin_sub_overflow(tmp, alu_val, &regs->a);
+		regs->flags.z = regs->a == 0;
+		regs->flags.n = 1;
 	});
 
 	OP(and, 1, {
-		regs.flags.h = 1;
-		regs.flags.n = regs.flags.c = 0;
-		regs.a &= alu_val;
-		regs.flags.z = !regs.a;
+		regs->flags.h = 1;
+		regs->flags.n = regs->flags.c = 0;
+		regs->a &= alu_val;
+		regs->flags.z = !regs->a;
 	});
 
 	OP(xor, 1, {
-		regs.flags.h = regs.flags.n = regs.flags.c = 0;
-		regs.a ^= alu_val;
-		regs.flags.z = !regs.a;
+		regs->flags.h = regs->flags.n = regs->flags.c = 0;
+		regs->a ^= alu_val;
+		regs->flags.z = !regs->a;
 	});
 
 	OP(or, 1, {
-		regs.flags.h = regs.flags.n = regs.flags.c = 0;
-		regs.a |= alu_val;
-		regs.flags.z = !regs.a;
+		regs->flags.h = regs->flags.n = regs->flags.c = 0;
+		regs->a |= alu_val;
+		regs->flags.z = !regs->a;
 	});
 
 	OP(cp, 1, {
 		uint8_t tmp;
-		regs.flags.h = (regs.a & 0x0F) < (alu_val & 0x0F);
-		regs.flags.c = __builtin_sub_overflow(regs.a, alu_val, &tmp);
-		regs.flags.z = tmp == 0;
-		regs.flags.n = 1;
+		regs->flags.h = (regs->a & 0x0F) < (alu_val & 0x0F);
+		regs->flags.c = __builtin_sub_overflow(regs->a, alu_val, &tmp);
+		regs->flags.z = tmp == 0;
+		regs->flags.n = 1;
 	});
 
 	OP(rlc, 0, {
-		regs.flags.c = R_READ(z) >> 7;
-		R_WRITE(z, (R_READ(z) << 1) | regs.flags.c);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		regs->flags.c = R_READ(z) >> 7;
+		R_WRITE(z, (R_READ(z) << 1) | regs->flags.c);
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rrc, 0, {
-		regs.flags.c = R_READ(z) & 1;
-		R_WRITE(z, (R_READ(z) >> 1) | regs.flags.c << 7);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		regs->flags.c = R_READ(z) & 1;
+		R_WRITE(z, (R_READ(z) >> 1) | regs->flags.c << 7);
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rl, 0, {
 		size_t newc = R_READ(z) >> 7;
-		R_WRITE(z, (R_READ(z) << 1) | regs.flags.c);
-		regs.flags.c = newc;
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		R_WRITE(z, (R_READ(z) << 1) | regs->flags.c);
+		regs->flags.c = newc;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(rr, 0, {
 		size_t newc = R_READ(z) & 1;
-		R_WRITE(z, (R_READ(z) >> 1) | regs.flags.c << 7);
-		regs.flags.c = newc;
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		R_WRITE(z, (R_READ(z) >> 1) | regs->flags.c << 7);
+		regs->flags.c = newc;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(sla, 0, {
-		regs.flags.c = R_READ(z) >> 7;
+		regs->flags.c = R_READ(z) >> 7;
 		R_WRITE(z, R_READ(z) << 1);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(sra, 0, {
-		regs.flags.c = R_READ(z) & 1; // ????
+		regs->flags.c = R_READ(z) & 1; // ????
 		R_WRITE(z, ((int8_t)R_READ(z)) >> 1);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 
 	OP(swap, 0, {
 		uint8_t tmp = ((R_READ(z) & 0xF) << 4) | (R_READ(z) >> 4);
 		R_WRITE(z, tmp);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = regs.flags.c = 0;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = regs->flags.c = 0;
 	});
 
 	OP(srl, 0, {
-		regs.flags.c = R_READ(z) & 1;
+		regs->flags.c = R_READ(z) & 1;
 		R_WRITE(z, R_READ(z) >> 1);
-		regs.flags.z = !R_READ(z);
-		regs.flags.n = regs.flags.h = 0;
+		regs->flags.z = !R_READ(z);
+		regs->flags.n = regs->flags.h = 0;
 	});
 end:;
 }
 
-void process_cpu(void)
+/**
+ * Apply the writes of the next block of the register log being played, and
+ * make the block as long as it was when recorded.
+ */
+static void replay_block(struct minigbs *gbs)
 {
-	while (regs.sp != h.sp)
-		cpu_step();
+	const struct reglog *log = gbs->replay;
+	const size_t	     b	 = gbs->replay_block;
+
+	/* Blocks of any length will do once the log has ended, as long as
+	 * they are not empty. */
+	if (b >= log->nblocks) {
+		audio_set_block(&gbs->audio, AUDIO_MAX_FRAMES);
+		return;
+	}
 
-	regs.pc = h.play_addr;
-	regs.sp -= 2;
+	for (size_t w = log->blocks[b].first; w < reglog_block_end(log, b); ++w)
+		mem_write(gbs, 0xFF00 + log->writes[w].reg, log->writes[w].val);
+
+	audio_set_block(&gbs->audio, log->blocks[b].frames);
+	gbs->replay_block++;
 }
 
-#ifdef AUDIO_DRIVER_SOKOL
-void sokol_audio_callback(float* buffer, int num_frames, int num_channels)
+void process_cpu(struct minigbs *gbs)
 {
-	audio_callback(NULL, (uint8_t *)buffer, num_frames * num_channels * sizeof(float));
+	const struct memo_entry *e;
+
+	if (gbs->replay != NULL) {
+		replay_block(gbs);
+		return;
+	}
+
+	/* A cached call makes the same writes, in the same order. */
+	if (gbs->memo != NULL && (e = memo_begin(gbs->memo, gbs)) != NULL) {
+		for (uint32_t i = e->first; i < e->first + e->nwrites; ++i)
+			mem_write(gbs, gbs->memo->writes[i].addr,
+				  gbs->memo->writes[i].val);
+
+		gbs->regs = e->regs;
+	} else {
+		while (gbs->regs.sp != gbs->h.sp)
+			cpu_step(gbs);
+
+		if (gbs->memo != NULL)
+			memo_end(gbs->memo, &gbs->regs);
+	}
+
+	gbs->regs.pc = gbs->h.play_addr;
+	gbs->regs.sp -= 2;
 }
-#endif
 
-#ifdef AUDIO_DRIVER_MINIAL
-mal_uint32 minial_audio_callback(mal_device* pDevice, mal_uint32 frameCount, void* pSamples)
+struct minigbs *minigbs_create(void)
+{
+	struct minigbs *gbs;
+
+	/* All state lives in one allocation, aligned to cache lines. */
+	if ((gbs = aligned_alloc(_Alignof(struct minigbs),
+				 sizeof(*gbs))) == NULL)
+		return NULL;
+
+	memset(gbs, 0, sizeof(*gbs));
+	audio_set_output(&gbs->audio, AUDIO_FORMAT_F32, 2, false);
+	return gbs;
+}
+
+struct minigbs *minigbs_clone(const struct minigbs *gbs)
 {
-	const uint_least8_t channels = 2;
-	(void)pDevice;
+	struct minigbs *clone;
+
+	if ((clone = aligned_alloc(_Alignof(struct minigbs),
+				   sizeof(*clone))) == NULL)
+		return NULL;
 
-	audio_callback(NULL, (uint8_t *)pSamples, frameCount * channels * sizeof(float));
-	return frameCount;
+	memcpy(clone, gbs, sizeof(*clone));
+
+	if (clone->rom != NULL)
+		__atomic_add_fetch(&clone->rom->refs, 1, __ATOMIC_RELAXED);
+
+	/* Stem buffers, the register log, VGM capture and the call cache
+	 * belong to the original. */
+	clone->audio.stems_enabled = false;
+	clone->audio.stem_samples  = NULL;
+	clone->reglog		   = NULL;
+	clone->vgm		   = NULL;
+	clone->memo		   = NULL;
+
+	return clone;
 }
-#endif
 
-int main(int argc, char **argv)
+size_t minigbs_state_size(void)
 {
-	FILE *f;
-	uint_least8_t song_no;
+	return offsetof(struct minigbs, rom);
+}
+
+/* Channel mutes are set by the listener, possibly from another thread, and
+ * are skipped when copying states. */
+#define MUTE_OFFSET offsetof(struct minigbs, audio.mute_mask)
+#define MUTE_END    (MUTE_OFFSET + sizeof(unsigned int))
+
+void minigbs_save(const struct minigbs *gbs, void *state)
+{
+	memcpy(state, gbs, MUTE_OFFSET);
+	memset((uint8_t *)state + MUTE_OFFSET, 0, MUTE_END - MUTE_OFFSET);
+	memcpy((uint8_t *)state + MUTE_END, (const uint8_t *)gbs + MUTE_END,
+	       minigbs_state_size() - MUTE_END);
+}
 
-	if (argc != 2 && argc != 3) {
-		fprintf(stderr, "Usage: %s file [song index]\n", argv[0]);
-		exit(EXIT_FAILURE);
+void minigbs_restore(struct minigbs *gbs, const void *state)
+{
+	const bool stems_enabled = gbs->audio.stems_enabled;
+	float (*stem_samples)[AUDIO_MAX_FRAMES * 2] = gbs->audio.stem_samples;
+
+	memcpy(gbs, state, MUTE_OFFSET);
+	memcpy((uint8_t *)gbs + MUTE_END, (const uint8_t *)state + MUTE_END,
+	       minigbs_state_size() - MUTE_END);
+
+	/* Pointers into the ROM are rebuilt, so that states may come from
+	 * another instance or process that loaded the same file. Register
+	 * logs have no ROM. */
+	if (gbs->rom != NULL) {
+		gbs->bank0	       = gbs->rom->bank0;
+		gbs->selected_rom_bank = bank_get(gbs->rom,
+						  gbs->selected_bank);
 	}
 
-	f = fopen(argv[1], "rb");
-	if (!f) {
-		fprintf(stderr, "Error opening file: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+	/* RAM was replaced without going through writes. */
+	gbs->ram_dirty = ~0ULL;
+	if (gbs->memo != NULL)
+		gbs->memo->state.dirty = ~0ULL;
+
+	/* Stem buffers are output buffers of this instance, not state. */
+	gbs->audio.stems_enabled = stems_enabled && stem_samples != NULL;
+	gbs->audio.stem_samples	 = stem_samples;
+}
+
+int minigbs_snapshot_write(const struct minigbs *gbs, const char *path)
+{
+	const struct minigbs_snapshot_header hdr = {
+		.magic = MINIGBS_SNAPSHOT_MAGIC,
+		.state_size = minigbs_state_size(),
+		.count	    = 1,
+		.song	    = gbs->song,
+		.gbs	    = gbs->h
+	};
+	FILE *f;
+	int   ret = 0;
+
+	if ((f = fopen(path, "wb")) == NULL)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(gbs, minigbs_state_size(), 1, f) != 1)
+		ret = -1;
+
+	if (fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+int minigbs_snapshot_check(const struct minigbs *gbs,
+			   const struct minigbs_snapshot_header *hdr)
+{
+	if (memcmp(hdr->magic, MINIGBS_SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->state_size != minigbs_state_size() ||
+	    memcmp(&hdr->gbs, &gbs->h, sizeof(hdr->gbs)) != 0) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (fread(&h, sizeof(h), 1, f) != 1) {
-		fprintf(stderr, "Error reading file: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+	return 0;
+}
+
+int minigbs_snapshot_read(struct minigbs *gbs, const char *path)
+{
+	struct minigbs_snapshot_header hdr;
+	void *			       state;
+	FILE *			       f;
+	int			       ret = -1;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return -1;
+
+	if ((state = malloc(minigbs_state_size())) == NULL)
+		goto out;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fread(state, minigbs_state_size(), 1, f) != 1) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto out;
 	}
 
-	if (strncmp(h.id, "GBS", 3) != 0) {
-		fprintf(stderr, "Error: Not a GBS file.\n");
-		exit(EXIT_FAILURE);
+	if (minigbs_snapshot_check(gbs, &hdr) != 0)
+		goto out;
+
+	if (hdr.count != 1) {
+		errno = EINVAL;
+		goto out;
 	}
 
-	if (h.version != 1) {
-		fprintf(stderr, "Error: Only GBS version 1 is supported.\n");
-		exit(EXIT_FAILURE);
+	minigbs_restore(gbs, state);
+	ret = 0;
+
+out:
+	free(state);
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Copy the part of the file data that falls into bank "which" into "page",
+ * zeroing the rest.
+ */
+static void bank_copy(const struct minigbs_rom *rom, const unsigned int which,
+		      uint8_t *page)
+{
+	const size_t start = (size_t)which * ROM_BANK_SIZE;
+	const size_t load  = rom->load_addr;
+	const size_t end   = load + (rom->map_size - GBS_DATA_OFFSET);
+	const size_t from  = MAX(start, load);
+	const size_t to	   = MIN(start + ROM_BANK_SIZE, end);
+
+	memset(page, 0, ROM_BANK_SIZE);
+
+	if (from < to)
+		memcpy(page + (from - start),
+		       rom->map + GBS_DATA_OFFSET + (from - load), to - from);
+}
+
+/**
+ * Share a copy of bank "which" through the bank cache.
+ * \return	Shared bank, or NULL if memory could not be allocated.
+ */
+static const uint8_t *bank_share(const struct minigbs_rom *rom,
+				 const unsigned int which)
+{
+	uint8_t page[ROM_BANK_SIZE];
+
+	bank_copy(rom, which, page);
+	return bank_cache_get(page);
+}
+
+/**
+ * Drop a reference to "rom", freeing its banks and file mapping once no
+ * instance uses it any more.
+ */
+static void rom_put(struct minigbs_rom *rom)
+{
+	if (rom == NULL ||
+	    __atomic_sub_fetch(&rom->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	bank_cache_put(rom->bank0);
+	bank_cache_put(rom->bank_head);
+	bank_cache_put(rom->bank_tail);
+
+	if (rom->map != NULL)
+		munmap((void *)rom->map, rom->map_size);
+
+	free(rom);
+}
+
+/**
+ * Map the GBS file at "path" and set up its banks.
+ */
+static enum minigbs_error rom_load(const char *path, struct GBSHeader *h,
+				   struct minigbs_rom **out)
+{
+	struct minigbs_rom *rom;
+	const uint8_t *	    data;
+	size_t		    end;
+	struct stat	    st;
+	void *		    map;
+	int		    fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return MINIGBS_ERR_IO;
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return MINIGBS_ERR_IO;
 	}
 
-	/* Get user selected song number to begin playing. */
-	song_no = argc > 2 ? atoi(argv[2]) : MAX(0, h.start_song - 1);
-
-	/* Check that user selected song number is within range of the number of
-	 * songs available in input GBS file. */
-	if (song_no >= h.song_count) {
-		fprintf(stderr,
-			"Error: The selected song index of %d is out of range. "
-			"This file has %d songs.\n",
-			song_no, h.song_count - 1U);
-		exit(EXIT_FAILURE);
+	if ((size_t)st.st_size < GBS_DATA_OFFSET) {
+		close(fd);
+		return MINIGBS_ERR_NOT_GBS;
 	}
 
-	/* Allocate required memory space for playing GBS file. */
-	mem = malloc((RAM_STOP_ADDR - RAM_START_ADDR) + 1);
-	if (mem == NULL) {
-		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
-		exit(EXIT_FAILURE);
+	if ((rom = calloc(1, sizeof(*rom))) == NULL) {
+		close(fd);
+		return MINIGBS_ERR_IO;
 	}
 
-	hram = calloc((HRAM_STOP_ADDR - HRAM_START_ADDR) + 1, 1);
-	if (hram == NULL) {
-		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
-		exit(EXIT_FAILURE);
+	/* Pages of the file are only read in once a bank is first used. */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		free(rom);
+		return MINIGBS_ERR_IO;
 	}
 
-	fseek(f, 0, SEEK_END);
-	fseek(f, 0x70, SEEK_SET);
+	rom->refs     = 1;
+	rom->map      = map;
+	rom->map_size = st.st_size;
 
-	banks[0] = NULL;
+	/* Banks are selected in no particular order, so avoid read ahead. */
+	madvise(map, st.st_size, MADV_RANDOM);
 
-	uint_least8_t bno = h.load_addr / ROM_BANK_SIZE;
-	uint_least16_t off = h.load_addr % ROM_BANK_SIZE;
+	memcpy(h, rom->map, sizeof(*h));
 
-	/* Read all ROM banks */
-	while (1) {
-		uint8_t *page;
+	if (strncmp(h->id, "GBS", 3) != 0) {
+		rom_put(rom);
+		return MINIGBS_ERR_NOT_GBS;
+	}
 
-		if ((page = malloc(ROM_BANK_SIZE)) == NULL) {
-			fprintf(stderr, "Error: malloc failure at %d.\n",
-					__LINE__);
-			exit(EXIT_FAILURE);
-		}
+	if (h->version != 1) {
+		rom_put(rom);
+		return MINIGBS_ERR_VERSION;
+	}
 
-		banks[bno] = page;
-		fread(page + off, 1, ROM_BANK_SIZE - off, f);
+	/* Data after the header is loaded to load_addr onwards. */
+	rom->load_addr = h->load_addr;
+	data	       = rom->map + GBS_DATA_OFFSET;
+	end	       = h->load_addr + (rom->map_size - GBS_DATA_OFFSET);
 
-		if (feof(f))
-			break;
-		else if (ferror(f)) {
-			fprintf(stderr, "Error: file read failure at %d.\n",
-					__LINE__);
-			exit(EXIT_FAILURE);
-		}
+	if (end == h->load_addr) {
+		rom_put(rom);
+		return MINIGBS_ERR_NOT_GBS;
+	}
 
-		off = 0;
-		if (++bno >= 32) {
-			fprintf(stderr, "Error: too many banks in GBS file.\n");
-			exit(EXIT_FAILURE);
-		}
+	if (end > (size_t)ROM_MAX_BANKS * ROM_BANK_SIZE) {
+		rom_put(rom);
+		return MINIGBS_ERR_TOO_MANY_BANKS;
 	}
 
-	/* Close input file after loading file. */
-	fclose(f);
+	/* Whole banks point straight into the mapping, whose pages the kernel
+	 * shares between instances playing the same file. Only bank 0, whose
+	 * start is patched with the start of the data, and partially filled
+	 * banks at either end of the data are copied, into pages shared by
+	 * content through the bank cache. */
+	rom->bank_first = h->load_addr / ROM_BANK_SIZE;
+	rom->bank_last	= (end - 1) / ROM_BANK_SIZE;
 
-	/* Initialising the selected ROM bank to the default of Bank 1. */
-	selected_rom_bank = banks[1];
+	{
+		uint8_t page[ROM_BANK_SIZE];
 
-	/* Initialise CPU registers. */
-	memset(&regs, 0, sizeof(regs));
+		bank_copy(rom, 0, page);
+		memcpy(page, data,
+		       MIN((size_t)0x62, rom->map_size - GBS_DATA_OFFSET));
 
-	if(banks[0] == NULL)
-		banks[0] = malloc(ROM_BANK_SIZE);
+		if ((rom->bank0 = bank_cache_get(page)) == NULL)
+			goto nomem;
+	}
 
-	if(h.load_addr >= ROM_BANK1_ADDR)
-		memcpy(banks[0], &banks[1][h.load_addr - ROM_BANK1_ADDR], 0x62);
-	else
-		memcpy(banks[0], &banks[0][h.load_addr], 0x62);
+	if (rom->bank_first > 0 && h->load_addr % ROM_BANK_SIZE != 0 &&
+	    (rom->bank_head = bank_share(rom, rom->bank_first)) == NULL)
+		goto nomem;
 
-	regs.sp = h.sp - 2;
-	regs.pc = h.init_addr;
-	regs.a  = song_no;
+	if (rom->bank_last > 0 && end % ROM_BANK_SIZE != 0 &&
+	    bank_get(rom, rom->bank_last) != rom->bank_head &&
+	    (rom->bank_tail = bank_share(rom, rom->bank_last)) == NULL)
+		goto nomem;
 
-	/* TODO: Check if removing this breaks anything. */
-	//mem[0xffff] = 1; // IE
+	*out = rom;
+	return MINIGBS_OK;
 
-	/* Load timer values from file. */
-	audio_write(0xff06, h.tma);
-	audio_write(0xff07, h.tac);
+nomem:
+	rom_put(rom);
+	return MINIGBS_ERR_IO;
+}
 
-	audio_init();
+/**
+ * Put the APU in its state after loading a file, with the timer values from
+ * the header.
+ */
+static void apu_reset(struct minigbs *gbs)
+{
+	memset(gbs->audio.mem, 0, sizeof(gbs->audio.mem));
+	audio_write(&gbs->audio, 0xff06, gbs->h.tma);
+	audio_write(&gbs->audio, 0xff07, gbs->h.tac);
 
-#if defined(AUDIO_DRIVER_SDL)
-	/* Initialise SDL audio. */
-	{
-		SDL_AudioDeviceID audio;
-		SDL_AudioSpec     got;
-		SDL_AudioSpec     want = {
-			    .freq     = AUDIO_SAMPLE_RATE,
-			    .channels = 2,
-			    .samples  = AUDIO_SAMPLE_RATE / 12U,
-			    .format   = AUDIO_F32SYS,
-			    .callback = audio_callback,
-		};
-
-		if (SDL_Init(SDL_INIT_AUDIO) != 0) {
-			fprintf(stderr, "Error: SDL_Init failure: %s\n",
-				SDL_GetError());
-			exit(EXIT_FAILURE);
-		}
+	audio_init(&gbs->audio);
+}
 
-		if ((audio = SDL_OpenAudioDevice(NULL, 0, &want, &got, 0)) == 0)
-		{
-			fprintf(stderr, "Error: SDL_OpenAudioDevice failure: "
-					"%s.\n",
-					SDL_GetError());
-			exit(EXIT_FAILURE);
-		}
+enum minigbs_error minigbs_load(struct minigbs *gbs, const char *path)
+{
+	struct GBSHeader *h = &gbs->h;
+	enum minigbs_error err;
 
-		/* Begin playing audio. */
-		SDL_PauseAudioDevice(audio, 0);
-	}
-#elif defined(AUDIO_DRIVER_SOKOL)
-	/* Initialise SOKOL Audio. */
-	{
-		const saudio_desc sd = {
-			.stream_cb = sokol_audio_callback,
-			.sample_rate = AUDIO_SAMPLE_RATE,
-			.num_channels = 2
+	/* Drop all state of any previously loaded file, so that output does
+	 * not depend on what the instance played before. */
+	rom_put(gbs->rom);
+	gbs->rom	       = NULL;
+	gbs->bank0	       = NULL;
+	gbs->selected_rom_bank = NULL;
 
-		};
-		saudio_setup(&sd);
-	}
-#elif defined(AUDIO_DRIVER_MINIAL)
-	mal_device device;
-	mal_context audio_ctx;
-	mal_device_config config;
+	memset(gbs->mem, 0, sizeof(gbs->mem));
+	memset(gbs->hram, 0, sizeof(gbs->hram));
+	memset(gbs->audio.mem, 0, sizeof(gbs->audio.mem));
+	gbs->ram_dirty = ~0ULL;
+	gbs->replay    = NULL;
 
-	{
-		if(mal_context_init(NULL, 0, NULL, &audio_ctx) != MAL_SUCCESS){
-			fprintf(stderr, "mal_context_init failed.\n");
-			exit(1);
-		}
+	if (gbs->memo != NULL)
+		memo_clear(gbs->memo);
 
-		config = mal_device_config_init_playback(
-				mal_format_f32, 2, AUDIO_SAMPLE_RATE,
-				minial_audio_callback
-		);
+	if ((err = rom_load(path, h, &gbs->rom)) != MINIGBS_OK)
+		return err;
 
-		if (mal_device_init(NULL, mal_device_type_playback, NULL, &config, NULL, &device) != MAL_SUCCESS) {
-			printf("Failed to open playback device.\n");
-			return -3;
-		}
+	/* Initialising the selected ROM bank to the default of Bank 1. */
+	gbs->bank0	       = gbs->rom->bank0;
+	gbs->rom_bank	       = 1;
+	gbs->selected_bank     = 1;
+	gbs->selected_rom_bank = bank_get(gbs->rom, 1);
 
-		if (mal_device_start(&device) != MAL_SUCCESS) {
-			printf("Failed to start playback device.\n");
-			mal_device_uninit(&device);
-			return -4;
-		}
-	}
-#elif defined(AUDIO_DRIVER_NONE)
-	float *samples = malloc(AUDIO_SAMPLE_RATE * sizeof(float));
-#else
-#error "No audio driver defined."
-#endif
+	/* TODO: Check if removing this breaks anything. */
+	//mem[0xffff] = 1; // IE
 
-	/* Fixes printf's not printing to stdout until exit in Windows. */
-	setbuf(stdout, NULL);
+	apu_reset(gbs);
 
-	fprintf(stdout, "Keys: q = Quit, n = Next, p = Previous\n");
+	/* Initialise CPU registers. */
+	memset(&gbs->regs, 0, sizeof(gbs->regs));
 
-	while (1) {
-		switch (getchar()) {
-		case 'q':
-			goto out;
+	return minigbs_song(gbs, MAX(0, h->start_song - 1));
+}
 
-		case 'n':
-			if (song_no < h.song_count - 1U) {
-				regs.a  = ++song_no;
-				regs.sp = h.sp - 2;
-				regs.pc = h.init_addr;
-				fprintf(stdout, "Song %d of %d\n", song_no,
-					h.song_count - 1U);
-			}
-			break;
-
-		case 'p':
-			if (song_no > 0) {
-				regs.a  = --song_no;
-				regs.sp = h.sp - 2;
-				regs.pc = h.init_addr;
-				fprintf(stdout, "Song %d of %d\n", song_no,
-					h.song_count - 1U);
-			}
-			break;
-		}
-#if defined(AUDIO_DRIVER_NONE)
-		audio_callback(NULL, (uint8_t *)samples, AUDIO_SAMPLE_RATE * sizeof(float));
-#endif
+enum minigbs_error minigbs_song(struct minigbs *gbs, const unsigned int song)
+{
+	if (song >= gbs->h.song_count)
+		return MINIGBS_ERR_SONG;
+
+	gbs->regs.sp   = gbs->h.sp - 2;
+	gbs->regs.pc   = gbs->h.init_addr;
+	gbs->regs.a    = song;
+	gbs->song      = song;
+	gbs->position  = 0;
+
+	/* Register logs have no init routine to set up the APU. */
+	if (gbs->replay != NULL) {
+		gbs->replay_block = 0;
+		apu_reset(gbs);
 	}
 
-out:
-#if defined(AUDIO_DRIVER_SDL)
-	SDL_Quit();
-#elif defined(AUDIO_DRIVER_SOKOL)
-	saudio_shutdown();
-#elif defined(AUDIO_DRIVER_MINIAL)
-	mal_device_uninit(&device);
-#elif defined(AUDIO_DRIVER_NONE)
-	free(samples);
-#endif
+	return MINIGBS_OK;
+}
+
+void minigbs_replay(struct minigbs *gbs, const struct reglog *log,
+		    const struct GBSHeader *h)
+{
+	rom_put(gbs->rom);
+	gbs->rom	       = NULL;
+	gbs->bank0	       = NULL;
+	gbs->selected_rom_bank = NULL;
+
+	memset(gbs->mem, 0, sizeof(gbs->mem));
+	memset(gbs->hram, 0, sizeof(gbs->hram));
+	memset(&gbs->regs, 0, sizeof(gbs->regs));
+	gbs->ram_dirty = ~0ULL;
+
+	gbs->h		  = *h;
+	gbs->h.song_count = 1;
+	gbs->h.start_song = 1;
+	gbs->replay	  = log;
+
+	minigbs_song(gbs, 0);
+}
+
+unsigned int minigbs_render(struct minigbs *gbs, void *out,
+			    const unsigned int frames)
+{
+	return audio_render(gbs, out, NULL, frames);
+}
 
-	audio_deinit();
+unsigned int minigbs_render_stems(struct minigbs *gbs, void *out,
+				  float *stems[4], const unsigned int frames)
+{
+	return audio_render(gbs, out, stems, frames);
+}
 
-	do {
-		free(banks[bno]);
-	} while(bno--);
+void minigbs_destroy(struct minigbs *gbs)
+{
+	if (gbs == NULL)
+		return;
 
-	free(mem);
-	free(hram);
+	audio_deinit(&gbs->audio);
+	rom_put(gbs->rom);
+	free(gbs);
+}
+
+const char *minigbs_strerror(const enum minigbs_error err)
+{
+	switch (err) {
+	case MINIGBS_OK:
+		return "Success";
+	case MINIGBS_ERR_IO:
+		return strerror(errno);
+	case MINIGBS_ERR_NOT_GBS:
+		return "Not a GBS file";
+	case MINIGBS_ERR_VERSION:
+		return "Only GBS version 1 is supported";
+	case MINIGBS_ERR_TOO_MANY_BANKS:
+		return "Too many banks in GBS file";
+	case MINIGBS_ERR_SONG:
+		return "Song index out of range";
+	}
 
-	return EXIT_SUCCESS;
+	return "Unknown error";
 }
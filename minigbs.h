@@ -1 +1,275 @@
-extern void process_cpu(void);
+#ifndef MINIGBS_H
+#define MINIGBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio.h"
+
+struct memo;
+struct reglog;
+struct vgm;
+
+#define ROM_BANK_SIZE	0x4000
+/* Largest ROM addressable by MBC5. */
+#define ROM_MAX_BANKS	512
+
+#define RAM_SIZE	0x4000
+/* RAM is tracked for writes in 64 pages. */
+#define RAM_PAGE_SIZE	(RAM_SIZE / 64)
+#define HRAM_SIZE	0x7F
+
+struct GBSHeader {
+	char     id[3];
+	uint8_t  version;
+	uint8_t  song_count;
+	uint8_t  start_song;
+	uint16_t load_addr;
+	uint16_t init_addr;
+	uint16_t play_addr;
+	uint16_t sp;
+	uint8_t  tma;
+	uint8_t  tac;
+	char     title[32];
+	char     author[32];
+	char     copyright[32];
+} __attribute__((packed));
+
+struct cpu_regs {
+	union {
+		uint16_t af;
+		struct {
+			union {
+				struct {
+					uint8_t _pad : 4, c : 1, h : 1, n : 1,
+						z : 1;
+				};
+				uint8_t all;
+			} flags;
+			uint8_t a;
+		};
+	};
+	union {
+		uint16_t bc;
+		struct {
+			uint8_t c, b;
+		};
+	};
+	union {
+		uint16_t de;
+		struct {
+			uint8_t e, d;
+		};
+	};
+	union {
+		uint16_t hl;
+		struct {
+			uint8_t l, h;
+		};
+	};
+	uint16_t sp, pc;
+};
+
+/**
+ * A loaded GBS file, shared read-only by all instances playing it.
+ */
+struct minigbs_rom {
+	unsigned int refs;
+
+	/* Read-only mapping of the file, which most banks point into. */
+	const uint8_t *map;
+	size_t	       map_size;
+	uint16_t       load_addr;
+
+	/* Range of banks holding file data, and shared copies of bank 0 and of
+	 * partially filled banks at either end of that range. */
+	unsigned int   bank_first, bank_last;
+	const uint8_t *bank0;
+	const uint8_t *bank_head;
+	const uint8_t *bank_tail;
+};
+
+/**
+ * An emulator instance playing a single GBS file. Instances share no state, so
+ * each may be driven from its own thread.
+ *
+ * All state is held in this one cache line aligned block, with the fields
+ * used by every instruction first. Everything before "rom" is the saved
+ * state of the instance, so saving and restoring are a single copy.
+ */
+struct minigbs {
+	struct cpu_regs regs;
+	const uint8_t * bank0;
+	const uint8_t * selected_rom_bank;
+	unsigned int	rom_bank;
+	unsigned int	selected_bank;
+
+	/* Current song, and frames rendered since it was selected. */
+	unsigned int song;
+	uint64_t     position;
+
+	/* Next block of the register log played instead of the play routine. */
+	uint64_t replay_block;
+
+	/* One bit for each page of RAM written since the bits were cleared. */
+	uint64_t ram_dirty;
+
+	struct GBSHeader h;
+
+	uint8_t hram[HRAM_SIZE];
+	uint8_t mem[RAM_SIZE] __attribute__((aligned(64)));
+
+	struct audio audio;
+
+	struct minigbs_rom *rom;
+
+	/* Log receiving every audio register write, if not NULL. */
+	struct reglog *reglog;
+
+	/* VGM file capturing every audio register write, if not NULL. */
+	struct vgm *vgm;
+
+	/* Register log played instead of running the CPU, if not NULL. */
+	const struct reglog *replay;
+
+	/* Cache of calls replacing the CPU where it can, if not NULL. */
+	struct memo *memo;
+} __attribute__((aligned(64)));
+
+enum minigbs_error {
+	MINIGBS_OK = 0,
+	/* errno holds the cause. */
+	MINIGBS_ERR_IO,
+	MINIGBS_ERR_NOT_GBS,
+	MINIGBS_ERR_VERSION,
+	MINIGBS_ERR_TOO_MANY_BANKS,
+	MINIGBS_ERR_SONG
+};
+
+/**
+ * Allocate a new emulator instance.
+ * \return	Instance, or NULL if memory could not be allocated.
+ */
+struct minigbs *minigbs_create(void);
+
+/**
+ * Load the GBS file at "path" into "gbs" and select its default song.
+ * \return	MINIGBS_OK on success, or an error code otherwise.
+ */
+enum minigbs_error minigbs_load(struct minigbs *gbs, const char *path);
+
+/**
+ * Play the register log "log" in "gbs" instead of a GBS file, as a single song
+ * described by "h". Each play call applies the writes of the next block of
+ * the log to the APU, in its state after loading a file, and renders the
+ * block as long as it was recorded, so that no CPU is emulated. Past the end
+ * of the log, blocks of AUDIO_MAX_FRAMES are rendered without writes. "log"
+ * must outlive "gbs" and any copy of it.
+ */
+void minigbs_replay(struct minigbs *gbs, const struct reglog *log,
+		    const struct GBSHeader *h);
+
+/**
+ * Restart playback at song index "song".
+ * \return	MINIGBS_OK, or MINIGBS_ERR_SONG if "song" is out of range.
+ */
+enum minigbs_error minigbs_song(struct minigbs *gbs, unsigned int song);
+
+/**
+ * Fill "out" with exactly "frames" frames of audio in the format selected with
+ * audio_set_output(), running the play routine as often as needed. Output
+ * continues seamlessly across calls of any size, and no memory is allocated.
+ * \return	Number of play routine calls made.
+ */
+unsigned int minigbs_render(struct minigbs *gbs, void *out,
+			    unsigned int frames);
+
+/**
+ * Same as minigbs_render(), but also fills each of the four buffers in "stems"
+ * with "frames" frames of a single channel. Requires stems to be enabled with
+ * audio_stems().
+ * \return	Number of play routine calls made.
+ */
+unsigned int minigbs_render_stems(struct minigbs *gbs, void *out,
+				  float *stems[4], unsigned int frames);
+
+/**
+ * Allocate a copy of "gbs", which continues playback exactly where "gbs" is.
+ * The loaded file is shared with "gbs"; stems are not enabled in the copy.
+ * \return	Copy, or NULL if memory could not be allocated.
+ */
+struct minigbs *minigbs_clone(const struct minigbs *gbs);
+
+/**
+ * Size in bytes of the state saved by minigbs_save().
+ */
+size_t minigbs_state_size(void);
+
+/**
+ * Save the complete emulator state of "gbs" into "state", which holds at
+ * least minigbs_state_size() bytes. This includes the CPU, RAM, selected
+ * bank, APU registers and channels, play rate, samples not yet consumed and
+ * the output format they are in. Channel mutes are not saved.
+ */
+void minigbs_save(const struct minigbs *gbs, void *state);
+
+/**
+ * Restore a state saved by minigbs_save(). The instance the state was saved
+ * from must have had the same file loaded as "gbs", but need not be "gbs".
+ * The channel mutes of "gbs" are kept.
+ */
+void minigbs_restore(struct minigbs *gbs, const void *state);
+
+#define MINIGBS_SNAPSHOT_MAGIC "MGBSNAP2"
+
+/**
+ * Header of snapshot files. States are raw copies of the instance, so files
+ * are only valid for the build that wrote them and the same GBS file, which
+ * the state size and a copy of the GBS header check for.
+ */
+struct minigbs_snapshot_header {
+	char		 magic[8];
+	uint32_t	 state_size;
+	uint32_t	 count;
+	uint32_t	 song;
+	uint32_t	 interval;
+	struct GBSHeader gbs;
+};
+
+/**
+ * Write the state of "gbs" to the snapshot file "path".
+ * \return	0 on success, or -1 with errno set.
+ */
+int minigbs_snapshot_write(const struct minigbs *gbs, const char *path);
+
+/**
+ * Restore "gbs" from the snapshot file "path", which must have been written
+ * with the same GBS file loaded.
+ * \return	0 on success, or -1 with errno set; EINVAL if the file does not
+ *		match.
+ */
+int minigbs_snapshot_read(struct minigbs *gbs, const char *path);
+
+/**
+ * Check that the snapshot file header "hdr" matches "gbs".
+ * \return	0 if it does, or -1 with errno set to EINVAL.
+ */
+int minigbs_snapshot_check(const struct minigbs *gbs,
+			   const struct minigbs_snapshot_header *hdr);
+
+/**
+ * Free an instance and all memory it holds.
+ */
+void minigbs_destroy(struct minigbs *gbs);
+
+/**
+ * Human readable description of "err".
+ */
+const char *minigbs_strerror(enum minigbs_error err);
+
+/**
+ * Run the CPU until the current init or play routine returns.
+ */
+void process_cpu(struct minigbs *gbs);
+
+#endif
@@ -0,0 +1,311 @@
+#include "pipeline.h"
+#include "reglog.h"
+#include "vgm.h"
+#include "wav.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Batches queued ahead of synthesis; a power of two. Each is usually one
+ * play call, so this bounds how far the play routine runs ahead. */
+#define PIPELINE_DEPTH		4
+
+/* Writes held by a batch. Play calls making more use several batches. */
+#define PIPELINE_BATCH_WRITES	256
+
+/* Frames synthesised between writes when rendering to a file. */
+#define PIPELINE_RENDER_FRAMES	32768
+
+/**
+ * Writes made by a play call, and the frames of the block rendered after it.
+ * With "more" set, the play call continues in the next batch.
+ */
+struct pipeline_batch {
+	uint16_t	    nwrites;
+	uint16_t	    frames;
+	bool		    more;
+	struct reglog_write writes[PIPELINE_BATCH_WRITES];
+};
+
+struct pipeline {
+	struct minigbs *gbs;
+	struct audio *	synth;
+	pthread_t	thread;
+	struct reglog	log;
+
+	/* Single producer, single consumer ring. The play routine thread
+	 * advances "tail" and the synthesis thread "head"; "space" wakes the
+	 * former once the latter has freed a slot, and "queued" the latter
+	 * once the former has queued a batch or stopped. */
+	struct pipeline_batch slots[PIPELINE_DEPTH];
+	unsigned int	      head;
+	unsigned int	      tail;
+	sem_t		      space;
+	sem_t		      queued;
+
+	/* Song to switch to, or -1. */
+	int  song;
+	bool started;
+	bool stop;
+	bool done;
+};
+
+/**
+ * Wait for a free slot at the tail of the queue.
+ * \return	The slot, to be queued with pipeline_push() once filled, or
+ *		NULL if the pipeline is stopping instead.
+ */
+static struct pipeline_batch *pipeline_slot(struct pipeline *p)
+{
+	while (p->tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) ==
+	       PIPELINE_DEPTH) {
+		if (__atomic_load_n(&p->stop, __ATOMIC_RELAXED))
+			return NULL;
+
+		sem_wait(&p->space);
+	}
+
+	return &p->slots[p->tail % PIPELINE_DEPTH];
+}
+
+static void pipeline_push(struct pipeline *p)
+{
+	__atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+	sem_post(&p->queued);
+}
+
+static void *pipeline_cpu(void *arg)
+{
+	struct pipeline *p   = arg;
+	struct minigbs * gbs = p->gbs;
+
+	while (!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+		const int song = __atomic_exchange_n(&p->song, -1,
+						     __ATOMIC_ACQUIRE);
+		size_t	  w    = 0;
+
+		if (song >= 0)
+			minigbs_song(gbs, song);
+
+		p->log.nwrites = 0;
+		process_cpu(gbs);
+		audio_update(&gbs->audio);
+
+		if (gbs->vgm != NULL)
+			vgm_wait(gbs->vgm, gbs->audio.block_frames);
+
+		if (p->log.failed)
+			break;
+
+		/* At least one batch per play call, even without writes. */
+		do {
+			struct pipeline_batch *b;
+
+			if ((b = pipeline_slot(p)) == NULL)
+				goto out;
+
+			b->nwrites = MIN(p->log.nwrites - w,
+					 (size_t)PIPELINE_BATCH_WRITES);
+			b->frames  = gbs->audio.block_frames;
+			b->more	   = w + b->nwrites < p->log.nwrites;
+			memcpy(b->writes, p->log.writes + w,
+			       b->nwrites * sizeof(*b->writes));
+			w += b->nwrites;
+
+			pipeline_push(p);
+		} while (w < p->log.nwrites);
+	}
+
+out:
+	__atomic_store_n(&p->done, true, __ATOMIC_RELEASE);
+	sem_post(&p->queued);
+	return NULL;
+}
+
+struct pipeline *pipeline_start(struct minigbs *gbs)
+{
+	struct pipeline *p;
+	int		 err;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+
+	if ((p->synth = aligned_alloc(_Alignof(struct audio),
+				      sizeof(*p->synth))) == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	/* Synthesis continues from the APU as it is, in its own copy. */
+	memcpy(p->synth, &gbs->audio, sizeof(*p->synth));
+	p->synth->stems_enabled = false;
+	p->synth->stem_samples	= NULL;
+
+	/* The play routine only needs the play rate and register state. */
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&gbs->audio, c, true);
+
+	reglog_init(&p->log);
+	gbs->reglog = &p->log;
+	p->gbs	    = gbs;
+	p->song	    = -1;
+	sem_init(&p->space, 0, 0);
+	sem_init(&p->queued, 0, 0);
+
+	if ((err = pthread_create(&p->thread, NULL, pipeline_cpu, p)) != 0) {
+		pipeline_stop(p);
+		errno = err;
+		return NULL;
+	}
+
+	p->started = true;
+	return p;
+}
+
+/**
+ * Apply the next play call from the queue to the synthesised APU and render
+ * its block.
+ * \return	false if the play routine thread has stopped.
+ */
+static bool pipeline_block(struct pipeline *p)
+{
+	unsigned int frames = 0;
+	bool	     more   = true;
+
+	while (more) {
+		const unsigned int	     head = p->head;
+		const struct pipeline_batch *b;
+
+		/* The play routine runs far faster than realtime, so it only
+		 * falls behind briefly, if ever; sleep rather than spin in the
+		 * audio callback until it catches up. */
+		while (__atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == head) {
+			if (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) ==
+				    head)
+				return false;
+
+			sem_wait(&p->queued);
+		}
+
+		b = &p->slots[head % PIPELINE_DEPTH];
+		for (unsigned int i = 0; i < b->nwrites; ++i)
+			audio_write(p->synth, 0xFF00 + b->writes[i].reg,
+				    b->writes[i].val);
+
+		frames = b->frames;
+		more   = b->more;
+		__atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+		sem_post(&p->space);
+	}
+
+	/* Blocks keep the lengths the play routine thread gave them, which
+	 * replayed logs set without a play rate. */
+	audio_set_block(p->synth, frames);
+	audio_update(p->synth);
+	return true;
+}
+
+void pipeline_render(struct pipeline *p, void *out, unsigned int frames)
+{
+	struct audio *a	  = p->synth;
+	uint8_t *     dst = out;
+
+	while (frames) {
+		unsigned int n;
+
+		while (a->pending == 0) {
+			if (!pipeline_block(p)) {
+				memset(dst, 0, frames * a->frame_size);
+				return;
+			}
+		}
+
+		n = MIN(frames, a->pending);
+		memcpy(dst,
+		       (uint8_t *)a->samples +
+			       (a->block_frames - a->pending) * a->frame_size,
+		       n * a->frame_size);
+
+		dst += n * a->frame_size;
+		a->pending -= n;
+		frames -= n;
+	}
+}
+
+struct audio *pipeline_audio(struct pipeline *p)
+{
+	return p->synth;
+}
+
+void pipeline_song(struct pipeline *p, const unsigned int song)
+{
+	__atomic_store_n(&p->song, (int)song, __ATOMIC_RELEASE);
+}
+
+void pipeline_stop(struct pipeline *p)
+{
+	__atomic_store_n(&p->stop, true, __ATOMIC_RELAXED);
+	sem_post(&p->space);
+
+	if (p->started)
+		pthread_join(p->thread, NULL);
+
+	p->gbs->reglog = NULL;
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&p->gbs->audio, c, audio_muted(p->synth, c));
+
+	sem_destroy(&p->space);
+	sem_destroy(&p->queued);
+	reglog_free(&p->log);
+	free(p->synth);
+	free(p);
+}
+
+int render_pipelined(struct minigbs *gbs, const char *path,
+		     const float seconds, const enum audio_format fmt,
+		     const unsigned int channels)
+{
+	const size_t	 frame	= audio_frame_size(&gbs->audio);
+	uint64_t	 frames = seconds * AUDIO_SAMPLE_RATE;
+	struct pipeline *p;
+	struct wav	 out;
+	uint8_t *	 buf;
+	int		 ret = 0;
+
+	if ((buf = malloc(PIPELINE_RENDER_FRAMES * frame)) == NULL)
+		return -1;
+
+	if (wav_open(&out, path, channels, AUDIO_SAMPLE_RATE,
+		     fmt == AUDIO_FORMAT_S16 ? 16 : 32) != 0) {
+		free(buf);
+		return -1;
+	}
+
+	if ((p = pipeline_start(gbs)) == NULL)
+		ret = -1;
+
+	while (ret == 0 && frames > 0) {
+		const unsigned int n = MIN(frames, PIPELINE_RENDER_FRAMES);
+
+		pipeline_render(p, buf, n);
+		if (wav_write(&out, buf, n * frame) != 0)
+			ret = -1;
+
+		frames -= n;
+	}
+
+	if (p != NULL)
+		pipeline_stop(p);
+
+	if (wav_close(&out) != 0)
+		ret = -1;
+
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "minigbs.h"
+
+struct pipeline;
+
+/**
+ * Start running the play routine of "gbs" on a thread of its own, ahead of
+ * synthesis. Each play call hands its audio register writes to the thread
+ * calling pipeline_render() through a bounded lock-free queue, so that play
+ * call N + 1 runs while block N is synthesised. "gbs" belongs to the
+ * pipeline until pipeline_stop(); its own channels are muted, as only a copy
+ * of its APU is synthesised.
+ * \return	Pipeline, or NULL with errno set.
+ */
+struct pipeline *pipeline_start(struct minigbs *gbs);
+
+/**
+ * Same as minigbs_render(), for the instance running in "p". Only one thread
+ * may call this at a time.
+ */
+void pipeline_render(struct pipeline *p, void *out, unsigned int frames);
+
+/**
+ * APU being synthesised, for muting channels.
+ */
+struct audio *pipeline_audio(struct pipeline *p);
+
+/**
+ * Restart playback at song index "song", which must be in range, from the
+ * next play call. Blocks already queued are still played.
+ */
+void pipeline_song(struct pipeline *p, unsigned int song);
+
+/**
+ * Stop the play routine thread and free "p". The instance it ran is left
+ * where the thread stopped, which is ahead of the output, with the channels
+ * muted that were muted in the synthesised APU.
+ */
+void pipeline_stop(struct pipeline *p);
+
+/**
+ * Same as render_wav() without stems, but with the play routine running in a
+ * pipeline as during playback with -T. Synthesis applies the register writes
+ * of each play call before rendering its block, as a serial render does, so
+ * the output is bit-identical to it. "gbs" is left where the play routine
+ * stopped, which is ahead of the output.
+ * \return	0 on success, or -1 with errno set.
+ */
+int render_pipelined(struct minigbs *gbs, const char *path, float seconds,
+		     enum audio_format fmt, unsigned int channels);
+
+#endif
@@ -0,0 +1,186 @@
+#include "reglog.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Initial number of writes and blocks, doubled whenever the log fills. */
+#define REGLOG_INITIAL	4096
+
+void reglog_init(struct reglog *log)
+{
+	memset(log, 0, sizeof(*log));
+}
+
+void reglog_free(struct reglog *log)
+{
+	free(log->writes);
+	free(log->blocks);
+	reglog_init(log);
+}
+
+void reglog_grow_write(struct reglog *log, const uint16_t addr,
+		       const uint8_t val)
+{
+	const size_t alloc = log->writes_alloc ? log->writes_alloc * 2 :
+						 REGLOG_INITIAL;
+	struct reglog_write *writes;
+
+	if ((writes = realloc(log->writes, alloc * sizeof(*writes))) == NULL) {
+		log->failed = true;
+		return;
+	}
+
+	log->writes	  = writes;
+	log->writes_alloc = alloc;
+	reglog_write(log, addr, val);
+}
+
+struct reglog_block *reglog_block(struct reglog *log)
+{
+	struct reglog_block *b;
+
+	if (log->nblocks == log->blocks_alloc) {
+		const size_t alloc = log->blocks_alloc ?
+					     log->blocks_alloc * 2 :
+					     REGLOG_INITIAL;
+		struct reglog_block *blocks;
+
+		blocks = realloc(log->blocks, alloc * sizeof(*blocks));
+		if (blocks == NULL) {
+			log->failed = true;
+			return NULL;
+		}
+
+		log->blocks	  = blocks;
+		log->blocks_alloc = alloc;
+	}
+
+	b	  = &log->blocks[log->nblocks++];
+	b->first  = log->nwrites;
+	b->frames = 0;
+	return b;
+}
+
+int reglog_record(struct minigbs *gbs, struct reglog *log,
+		  const uint64_t frames)
+{
+	uint64_t done = 0;
+
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&gbs->audio, c, true);
+
+	gbs->reglog = log;
+
+	while (done < frames) {
+		struct reglog_block *b;
+
+		if ((b = reglog_block(log)) == NULL)
+			break;
+
+		process_cpu(gbs);
+		audio_update(&gbs->audio);
+		b->frames = gbs->audio.block_frames;
+		done += b->frames;
+	}
+
+	gbs->reglog = NULL;
+	return log->failed ? -1 : 0;
+}
+
+int reglog_save(const struct reglog *log, const struct GBSHeader *h,
+		const char *path)
+{
+	const struct reglog_file_header hdr = {
+		.magic	 = REGLOG_FILE_MAGIC,
+		.nblocks = log->nblocks,
+		.nwrites = log->nwrites,
+		.gbs	 = *h,
+	};
+	FILE *f;
+	int   ret = 0;
+
+	if ((f = fopen(path, "wb")) == NULL)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(log->blocks, sizeof(*log->blocks), log->nblocks, f) !=
+		    log->nblocks ||
+	    fwrite(log->writes, sizeof(*log->writes), log->nwrites, f) !=
+		    log->nwrites)
+		ret = -1;
+
+	if (fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+/**
+ * Check that every block of "log" starts within its writes and in order, and
+ * fits in an audio block, and that every write is to an audio register.
+ */
+static bool reglog_valid(const struct reglog *log)
+{
+	for (size_t b = 0; b < log->nblocks; ++b) {
+		if (log->blocks[b].first > reglog_block_end(log, b) ||
+		    log->blocks[b].frames > AUDIO_MAX_FRAMES)
+			return false;
+	}
+
+	for (size_t w = 0; w < log->nwrites; ++w) {
+		if (log->writes[w].reg < 0x06 || log->writes[w].reg > 0x3F)
+			return false;
+	}
+
+	return true;
+}
+
+int reglog_load(struct reglog *log, struct GBSHeader *h, const char *path)
+{
+	struct reglog_file_header hdr;
+	FILE *			  f;
+	int			  ret = -1;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, REGLOG_FILE_MAGIC, sizeof(hdr.magic)) != 0) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto out;
+	}
+
+	log->blocks = malloc(hdr.nblocks * sizeof(*log->blocks) + 1);
+	log->writes = malloc(hdr.nwrites * sizeof(*log->writes) + 1);
+	if (log->blocks == NULL || log->writes == NULL)
+		goto out;
+
+	log->nblocks = log->blocks_alloc = hdr.nblocks;
+	log->nwrites = log->writes_alloc = hdr.nwrites;
+
+	if (fread(log->blocks, sizeof(*log->blocks), log->nblocks, f) !=
+		    log->nblocks ||
+	    fread(log->writes, sizeof(*log->writes), log->nwrites, f) !=
+		    log->nwrites) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto out;
+	}
+
+	if (!reglog_valid(log)) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	*h  = hdr.gbs;
+	ret = 0;
+
+out:
+	if (ret != 0)
+		reglog_free(log);
+
+	fclose(f);
+	return ret;
+}
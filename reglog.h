@@ -0,0 +1,127 @@
+#ifndef REGLOG_H
+#define REGLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/**
+ * One write to an audio register, at address 0xFF00 + "reg".
+ */
+struct reglog_write {
+	uint8_t reg;
+	uint8_t val;
+};
+
+/**
+ * One play call: the index of its first write and the number of frames
+ * rendered after it, until the next play call.
+ */
+struct reglog_block {
+	uint32_t first;
+	uint32_t frames;
+};
+
+/**
+ * Log of the audio register writes made by the play routine, grouped by the
+ * play call that made them. As synthesis depends on nothing else, replaying
+ * the log into a copy of the APU state at its start reproduces the output.
+ */
+struct reglog {
+	struct reglog_write *writes;
+	size_t		     nwrites;
+	size_t		     writes_alloc;
+
+	struct reglog_block *blocks;
+	size_t		     nblocks;
+	size_t		     blocks_alloc;
+
+	/* Set once a write or block could not be stored. */
+	bool failed;
+};
+
+/**
+ * Prepare an empty log.
+ */
+void reglog_init(struct reglog *log);
+
+/**
+ * Free all memory held by "log".
+ */
+void reglog_free(struct reglog *log);
+
+/**
+ * Append a write to the log, growing it as needed. Called for every write
+ * to an audio register by the instance the log is attached to.
+ */
+void reglog_grow_write(struct reglog *log, uint16_t addr, uint8_t val);
+
+static inline void reglog_write(struct reglog *log, const uint16_t addr,
+				const uint8_t val)
+{
+	if (log->nwrites == log->writes_alloc) {
+		reglog_grow_write(log, addr, val);
+		return;
+	}
+
+	log->writes[log->nwrites].reg = addr - 0xFF00;
+	log->writes[log->nwrites].val = val;
+	log->nwrites++;
+}
+
+/**
+ * Start a new play call, with writes from now on belonging to it.
+ * \return	The new block, with "frames" set to 0, or NULL if memory could
+ *		not be allocated.
+ */
+struct reglog_block *reglog_block(struct reglog *log);
+
+/**
+ * Index one past the last write of block "i".
+ */
+static inline size_t reglog_block_end(const struct reglog *log, size_t i)
+{
+	return i + 1 < log->nblocks ? log->blocks[i + 1].first : log->nwrites;
+}
+
+/**
+ * Run the play routine of "gbs" with every channel muted, logging its writes
+ * into "log", until at least "frames" frames have been played. The channels
+ * of "gbs" are left muted.
+ * \return	0 on success, or -1 if memory could not be allocated.
+ */
+int reglog_record(struct minigbs *gbs, struct reglog *log, uint64_t frames);
+
+#define REGLOG_FILE_MAGIC "MGBSRLG1"
+
+/**
+ * Header of register log files, followed by the blocks and then the writes of
+ * the log. Logs start with a song, from the state of the APU after loading
+ * the GBS file whose header is "gbs".
+ */
+struct reglog_file_header {
+	char		 magic[8];
+	uint32_t	 nblocks;
+	uint32_t	 nwrites;
+	struct GBSHeader gbs;
+};
+
+/**
+ * Write "log", recorded from the start of a song of the GBS file with header
+ * "h", to the file "path".
+ * \return	0 on success, or -1 with errno set.
+ */
+int reglog_save(const struct reglog *log, const struct GBSHeader *h,
+		const char *path);
+
+/**
+ * Read the register log file "path" into "log", which must be empty, and the
+ * header of the GBS file it was recorded from into "h".
+ * \return	0 on success, or -1 with errno set; EINVAL if the file is not a
+ *		valid register log.
+ */
+int reglog_load(struct reglog *log, struct GBSHeader *h, const char *path);
+
+#endif
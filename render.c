@@ -0,0 +1,506 @@
+#include "render.h"
+#include "silence.h"
+#include "wav.h"
+#include "util.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Frames rendered per block when writing to a file. */
+#define RENDER_FRAMES		32768
+
+/**
+ * Write the file name of stem "i" of "path" to "buf", by inserting "-1" to
+ * "-4" before the extension.
+ */
+static void stem_path(char *buf, const size_t size, const char *path,
+		      const unsigned int i)
+{
+	const char *ext = strrchr(path, '.');
+	const char *sep = strrchr(path, '/');
+
+	if (ext == NULL || (sep != NULL && ext < sep))
+		ext = path + strlen(path);
+
+	snprintf(buf, size, "%.*s-%u%s", (int)(ext - path), path, i + 1, ext);
+}
+
+int render_wav(struct minigbs *gbs, const char *path, const float seconds,
+	       const bool stems, const enum audio_format fmt,
+	       const unsigned int channels, struct seek_index *idx)
+{
+	const size_t block = RENDER_FRAMES * 2 * sizeof(float);
+	const size_t frame = audio_frame_size(&gbs->audio);
+	struct wav   mix;
+	struct wav   stem[4];
+	uint8_t *    buf;
+	unsigned int frames = seconds * AUDIO_SAMPLE_RATE;
+	int	     ret    = 0;
+
+	/* One block for the mix, followed by a block for each stem. */
+	if ((buf = malloc(block * 5)) == NULL)
+		return -1;
+
+	if (wav_open(&mix, path, channels, AUDIO_SAMPLE_RATE,
+		     fmt == AUDIO_FORMAT_S16 ? 16 : 32) != 0) {
+		free(buf);
+		return -1;
+	}
+
+	if (stems) {
+		if (audio_stems(&gbs->audio, true) != 0) {
+			wav_close(&mix);
+			free(buf);
+			return -1;
+		}
+
+		for (unsigned int i = 0; i < 4; ++i) {
+			char name[FILENAME_MAX];
+
+			stem_path(name, sizeof(name), path, i);
+			if (wav_open(&stem[i], name, 2, AUDIO_SAMPLE_RATE,
+				     32) != 0) {
+				while (i--)
+					wav_close(&stem[i]);
+
+				wav_close(&mix);
+				free(buf);
+				return -1;
+			}
+		}
+	}
+
+	while (frames && ret == 0) {
+		unsigned int n = MIN(frames, RENDER_FRAMES);
+		size_t	     len;
+		int	     next;
+
+		/* Blocks end where the next snapshot is due. */
+		if (idx != NULL) {
+			if ((next = seek_next(gbs, idx, n)) < 0) {
+				ret = -1;
+				break;
+			}
+
+			n = next;
+		}
+
+		len = n * frame;
+
+		if (stems) {
+			float *stem_bufs[4] = { (float *)(buf + block),
+						(float *)(buf + block * 2),
+						(float *)(buf + block * 3),
+						(float *)(buf + block * 4) };
+
+			minigbs_render_stems(gbs, buf, stem_bufs, n);
+
+			for (unsigned int i = 0; i < 4 && ret == 0; ++i)
+				ret = wav_write(&stem[i], buf + block * (i + 1),
+						n * 2 * sizeof(float));
+		} else {
+			minigbs_render(gbs, buf, n);
+		}
+
+		if (ret == 0)
+			ret = wav_write(&mix, buf, len);
+
+		frames -= n;
+	}
+
+	if (ret == 0 && idx != NULL && seek_next(gbs, idx, 0) < 0)
+		ret = -1;
+
+	if (stems) {
+		for (unsigned int i = 0; i < 4; ++i) {
+			if (wav_close(&stem[i]) != 0)
+				ret = -1;
+		}
+
+		audio_stems(&gbs->audio, false);
+	}
+
+	if (wav_close(&mix) != 0)
+		ret = -1;
+
+	free(buf);
+	return ret;
+}
+
+int render_fade(const char *path, const bool stems, const float seconds)
+{
+	const uint32_t frames = seconds * AUDIO_SAMPLE_RATE;
+
+	if (wav_fade_out(path, frames) != 0)
+		return -1;
+
+	for (unsigned int i = 0; stems && i < 4; ++i) {
+		char name[FILENAME_MAX];
+
+		stem_path(name, sizeof(name), path, i);
+		if (wav_fade_out(name, frames) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int render_raw(struct minigbs *gbs, const int fd, const float seconds,
+	       struct seek_index *idx)
+{
+	const size_t	   frame  = audio_frame_size(&gbs->audio);
+	const bool	   endless = seconds <= 0;
+	unsigned long long frames = endless ? 0 : seconds * AUDIO_SAMPLE_RATE;
+	uint8_t *	   buf;
+	void (*old_pipe)(int);
+	int ret = 0;
+
+	if ((buf = malloc(RENDER_FRAMES * frame)) == NULL)
+		return -1;
+
+	/* A reader going away ends the stream rather than the process. */
+	old_pipe = signal(SIGPIPE, SIG_IGN);
+
+	while (endless || frames) {
+		unsigned int n =
+			endless ? RENDER_FRAMES : MIN(frames, RENDER_FRAMES);
+		size_t len;
+		int    next;
+
+		if (idx != NULL) {
+			if ((next = seek_next(gbs, idx, n)) < 0) {
+				ret = -1;
+				goto out;
+			}
+
+			n = next;
+		}
+
+		len = n * frame;
+		minigbs_render(gbs, buf, n);
+
+		/* Blocking writes stall rendering until the reader catches
+		 * up, so the loop never runs ahead of the pipe. */
+		for (size_t off = 0; off < len;) {
+			const ssize_t w = write(fd, buf + off, len - off);
+
+			if (w >= 0) {
+				off += w;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd,
+						      .events = POLLOUT };
+
+				poll(&pfd, 1, -1);
+			} else if (errno == EPIPE) {
+				goto out;
+			} else if (errno != EINTR) {
+				ret = -1;
+				goto out;
+			}
+		}
+
+		frames -= endless ? 0 : n;
+	}
+
+out:
+	if (ret == 0 && idx != NULL && seek_next(gbs, idx, 0) < 0)
+		ret = -1;
+
+	signal(SIGPIPE, old_pipe);
+	free(buf);
+	return ret;
+}
+
+int render_job(struct minigbs *gbs, const struct render_job *job,
+	       const struct render_opts *opts)
+{
+	enum minigbs_error err;
+	float		   seconds = job->seconds;
+
+	if ((err = minigbs_load(gbs, job->path)) != MINIGBS_OK) {
+		fprintf(stderr, "Error loading %s: %s.\n", job->path,
+			minigbs_strerror(err));
+		return -1;
+	}
+
+	if (minigbs_song(gbs, job->song) != MINIGBS_OK) {
+		fprintf(stderr, "Error: %s has no song index %u.\n", job->path,
+			job->song);
+		return -1;
+	}
+
+	audio_set_output(&gbs->audio, opts->fmt, opts->channels, opts->dither);
+
+	if (opts->silence > 0) {
+		uint64_t end;
+
+		switch (silence_find(gbs, opts->silence * AUDIO_SAMPLE_RATE,
+				     seconds * AUDIO_SAMPLE_RATE, &end)) {
+		case -1:
+			fprintf(stderr, "Error: malloc failure at %d.\n",
+				__LINE__);
+			return -1;
+
+		case 1:
+			seconds = end / AUDIO_SAMPLE_RATE;
+			break;
+		}
+	}
+
+	if (render_wav(gbs, job->out, seconds, false, opts->fmt,
+		       opts->channels, NULL) != 0) {
+		fprintf(stderr, "Error writing %s: %s\n", job->out,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int render_jobs_load(const char *path, struct render_job **jobs)
+{
+	FILE *		   f;
+	char *		   line	 = NULL;
+	size_t		   size	 = 0;
+	struct render_job *list	 = NULL;
+	unsigned int	   njobs = 0;
+	unsigned int	   alloc = 0;
+	unsigned int	   lineno = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+
+	while (getline(&line, &size, f) != -1) {
+		char *fields[4];
+		char *save;
+		char *end;
+		unsigned int i;
+
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		fields[0] = strtok_r(line, "\t", &save);
+		for (i = 1; i < 4; ++i) {
+			if ((fields[i] = strtok_r(NULL, "\t", &save)) == NULL)
+				break;
+		}
+
+		if (i < 4) {
+			fprintf(stderr, "%s:%u: Expected four fields.\n", path,
+				lineno);
+			goto invalid;
+		}
+
+		if (njobs == alloc) {
+			struct render_job *grown;
+
+			alloc = alloc ? alloc * 2 : 64;
+			grown = realloc(list, alloc * sizeof(*list));
+			if (grown == NULL)
+				goto fail;
+
+			list = grown;
+		}
+
+		list[njobs].song    = strtoul(fields[1], &end, 10);
+		list[njobs].seconds = *end == '\0' ? strtof(fields[2], &end) :
+						      0;
+
+		if (*end != '\0' || list[njobs].seconds <= 0) {
+			fprintf(stderr, "%s:%u: Invalid song or duration.\n",
+				path, lineno);
+			goto invalid;
+		}
+
+		list[njobs].path = strdup(fields[0]);
+		list[njobs].out	 = strdup(fields[3]);
+		if (list[njobs].path == NULL || list[njobs].out == NULL) {
+			njobs++;
+			goto fail;
+		}
+
+		njobs++;
+	}
+
+	if (ferror(f))
+		goto fail;
+
+	free(line);
+	fclose(f);
+
+	*jobs = list;
+	return njobs;
+
+invalid:
+	errno = EINVAL;
+fail:
+	free(line);
+	fclose(f);
+	render_jobs_free(list, njobs);
+	return -1;
+}
+
+void render_jobs_free(struct render_job *jobs, const unsigned int njobs)
+{
+	for (unsigned int i = 0; i < njobs; ++i) {
+		free(jobs[i].path);
+		free(jobs[i].out);
+	}
+
+	free(jobs);
+}
+
+struct render_batch;
+
+/**
+ * A worker thread and the range of jobs it has yet to start. The owner takes
+ * jobs from the front; thieves take half of the remaining jobs from the back.
+ */
+struct render_worker {
+	pthread_t	     thread;
+	pthread_mutex_t	     lock;
+	unsigned int	     head, tail;
+	unsigned int	     failed;
+	unsigned int	     id;
+	struct render_batch *batch;
+};
+
+struct render_batch {
+	const struct render_job * jobs;
+	const struct render_opts *opts;
+	struct render_worker *	  workers;
+	unsigned int		  nworkers;
+};
+
+/**
+ * Take the next job of worker "w", stealing from another worker once its own
+ * range is empty.
+ * \return	true if "*job" was set, or false if no work is left.
+ */
+static bool render_next(struct render_worker *w, unsigned int *job)
+{
+	struct render_batch *b = w->batch;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail) {
+		*job = w->head++;
+		pthread_mutex_unlock(&w->lock);
+		return true;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	for (unsigned int i = 1; i < b->nworkers; ++i) {
+		struct render_worker *victim =
+			&b->workers[(w->id + i) % b->nworkers];
+		unsigned int head, tail;
+
+		pthread_mutex_lock(&victim->lock);
+		tail = victim->tail;
+		head = tail - (tail - victim->head) / 2;
+		if (head == tail && victim->head < tail)
+			head--;
+		victim->tail = head;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (head == tail)
+			continue;
+
+		/* Keep the first stolen job, queue the rest as our own. */
+		pthread_mutex_lock(&w->lock);
+		w->head = head + 1;
+		w->tail = tail;
+		pthread_mutex_unlock(&w->lock);
+
+		*job = head;
+		return true;
+	}
+
+	return false;
+}
+
+static void *render_worker(void *arg)
+{
+	struct render_worker *w = arg;
+	struct minigbs *      gbs;
+	unsigned int	      job;
+
+	/* Jobs left behind by this worker are stolen by the others. */
+	if ((gbs = minigbs_create()) == NULL) {
+		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
+		return NULL;
+	}
+
+	while (render_next(w, &job)) {
+		if (render_job(gbs, &w->batch->jobs[job], w->batch->opts) != 0)
+			w->failed++;
+	}
+
+	minigbs_destroy(gbs);
+	return NULL;
+}
+
+int render_batch(const struct render_job *jobs, const unsigned int njobs,
+		 unsigned int threads, const struct render_opts *opts)
+{
+	struct render_batch b = { .jobs = jobs, .opts = opts };
+	unsigned int	    started;
+	int		    failed = 0;
+
+	threads = MIN(MAX(threads, 1U), MAX(njobs, 1U));
+
+	if ((b.workers = calloc(threads, sizeof(*b.workers))) == NULL)
+		return -1;
+
+	b.nworkers = threads;
+
+	/* Start with an even split of consecutive jobs. */
+	for (unsigned int i = 0; i < threads; ++i) {
+		struct render_worker *w = &b.workers[i];
+
+		w->id	 = i;
+		w->batch = &b;
+		w->head	 = (unsigned long long)njobs * i / threads;
+		w->tail	 = (unsigned long long)njobs * (i + 1) / threads;
+		pthread_mutex_init(&w->lock, NULL);
+	}
+
+	for (started = 0; started < threads; ++started) {
+		int err = pthread_create(&b.workers[started].thread, NULL,
+					 render_worker, &b.workers[started]);
+
+		if (err != 0) {
+			if (started == 0) {
+				errno = err;
+				failed = -1;
+			}
+			break;
+		}
+	}
+
+	/* Jobs of workers that could not be started are stolen by others. */
+	for (unsigned int i = 0; i < started; ++i)
+		pthread_join(b.workers[i].thread, NULL);
+
+	for (unsigned int i = 0; i < threads; ++i) {
+		struct render_worker *w = &b.workers[i];
+
+		/* Jobs still queued were abandoned by every worker. */
+		if (failed >= 0)
+			failed += w->failed + (w->tail - w->head);
+
+		pthread_mutex_destroy(&w->lock);
+	}
+
+	free(b.workers);
+	return failed;
+}
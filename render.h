@@ -0,0 +1,94 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+
+#include "minigbs.h"
+#include "seek.h"
+
+/**
+ * One song of a GBS file to render to a WAV file.
+ */
+struct render_job {
+	char *	     path;
+	unsigned int song;
+	float	     seconds;
+	char *	     out;
+};
+
+/**
+ * Output settings shared by all jobs of a batch. Songs that stay silent for
+ * "silence" seconds are cut off where the silence starts, unless it is 0.
+ */
+struct render_opts {
+	enum audio_format fmt;
+	unsigned int	  channels;
+	bool		  dither;
+	float		  silence;
+};
+
+/**
+ * Render "seconds" of the current song to the WAV file "path" without opening
+ * an audio device, in the output format "fmt" with "channels" channels. With
+ * "stems", the output of each channel is also written to its own file during
+ * the same pass. Unless "idx" is NULL, snapshots of the song are recorded into
+ * it on the way, as by seek_render().
+ * \return	0 on success, or -1 with errno set.
+ */
+int render_wav(struct minigbs *gbs, const char *path, float seconds,
+	       bool stems, enum audio_format fmt, unsigned int channels,
+	       struct seek_index *idx);
+
+/**
+ * Fade out the last "seconds" seconds of the WAV file "path" written by
+ * render_wav(), and of its stems with "stems".
+ * \return	0 on success, or -1 with errno set.
+ */
+int render_fade(const char *path, bool stems, float seconds);
+
+/**
+ * Write raw interleaved samples of the current song to "fd" in the output
+ * format of "gbs", for "seconds" or until "fd" is closed by its reader if
+ * "seconds" is 0. Rendering waits for each block to be written, so it only
+ * runs as fast as the reader consumes the samples. Unless "idx" is NULL,
+ * snapshots of the song are recorded into it on the way.
+ * \return	0 on success or once the reader has gone away, or -1 with errno
+ *		set.
+ */
+int render_raw(struct minigbs *gbs, int fd, float seconds,
+	       struct seek_index *idx);
+
+/**
+ * Load the file and song of "job" into "gbs" and render it, trimmed at the
+ * end of the song with a "silence" window in "opts". Failures are reported on
+ * stderr.
+ * \return	0 on success, or -1 on failure.
+ */
+int render_job(struct minigbs *gbs, const struct render_job *job,
+	       const struct render_opts *opts);
+
+/**
+ * Read a job list from "path". Each line holds a GBS file, song index,
+ * duration in seconds and output WAV file, separated by tabs. Empty lines and
+ * lines starting with '#' are ignored.
+ * \return	Number of jobs stored in "*jobs", or -1 with errno set.
+ */
+int render_jobs_load(const char *path, struct render_job **jobs);
+
+/**
+ * Free a job list returned by render_jobs_load().
+ */
+void render_jobs_free(struct render_job *jobs, unsigned int njobs);
+
+/**
+ * Render all "njobs" jobs using "threads" worker threads, each with its own
+ * emulator instance. Idle workers steal work from busy ones, so long and short
+ * jobs balance out. Every job starts from a freshly loaded instance, so the
+ * output does not depend on the number of threads.
+ * \return	Number of failed jobs, or -1 with errno set if the workers
+ *		could not be started.
+ */
+int render_batch(const struct render_job *jobs, unsigned int njobs,
+		 unsigned int threads, const struct render_opts *opts);
+
+#endif
@@ -0,0 +1,275 @@
+#include "rewind.h"
+#include "util.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Regions of the state compared at each capture, all whole words: the CPU
+ * and HRAM, each page of RAM, and the APU without its output buffers. */
+#define CORE_WORDS	(offsetof(struct minigbs, mem) / 8)
+#define PAGE_WORDS	(RAM_PAGE_SIZE / 8)
+#define AUDIO_OFFSET	offsetof(struct minigbs, audio)
+#define AUDIO_WORDS	(offsetof(struct audio, stems_enabled) / 8)
+
+/* A region is recorded as a bitmap of changed words, then those words. */
+#define REGION_MAX(words)	((words + 7) / 8 + (words) * 8)
+
+/* Records start and end with their own size, so the ring can be walked from
+ * either end, and hold the pages diffed after the mask of them. */
+#define RECORD_MAX							\
+	(2 * sizeof(uint32_t) + sizeof(uint64_t) + REGION_MAX(CORE_WORDS) + \
+	 REGION_MAX(AUDIO_WORDS) + 64 * REGION_MAX(PAGE_WORDS))
+
+/**
+ * Compare "words" words of "cur" with "prev", writing the XOR of those that
+ * differ to "dst" and updating "prev" to match.
+ * \return	Number of bytes written.
+ */
+static size_t region_diff(uint8_t *dst, const uint8_t *cur, uint8_t *prev,
+			  const size_t words)
+{
+	const size_t map_size = (words + 7) / 8;
+	uint8_t *    out      = dst + map_size;
+
+	memset(dst, 0, map_size);
+
+	for (size_t i = 0; i < words; i++) {
+		uint64_t a, b;
+
+		memcpy(&a, cur + i * 8, 8);
+		memcpy(&b, prev + i * 8, 8);
+
+		if (a == b)
+			continue;
+
+		b ^= a;
+		dst[i / 8] |= 1U << i % 8;
+		memcpy(out, &b, 8);
+		memcpy(prev + i * 8, &a, 8);
+		out += 8;
+	}
+
+	return out - dst;
+}
+
+/**
+ * Apply a region written by region_diff() to "state".
+ * \return	Number of bytes read from "src".
+ */
+static size_t region_undo(const uint8_t *src, uint8_t *state,
+			  const size_t words)
+{
+	const size_t   map_size = (words + 7) / 8;
+	const uint8_t *in	= src + map_size;
+
+	for (size_t i = 0; i < words; i++) {
+		uint64_t a, x;
+
+		if (!(src[i / 8] & 1U << i % 8))
+			continue;
+
+		memcpy(&a, state + i * 8, 8);
+		memcpy(&x, in, 8);
+		a ^= x;
+		memcpy(state + i * 8, &a, 8);
+		in += 8;
+	}
+
+	return in - src;
+}
+
+static void ring_put(struct rewind *rw, const uint8_t *src, const size_t n)
+{
+	const size_t at	   = (rw->start + rw->used) % rw->size;
+	const size_t first = MIN(n, rw->size - at);
+
+	memcpy(rw->buf + at, src, first);
+	memcpy(rw->buf, src + first, n - first);
+	rw->used += n;
+}
+
+static void ring_get(const struct rewind *rw, const size_t off, uint8_t *dst,
+		     const size_t n)
+{
+	const size_t at	   = off % rw->size;
+	const size_t first = MIN(n, rw->size - at);
+
+	memcpy(dst, rw->buf + at, first);
+	memcpy(dst + first, rw->buf, n - first);
+}
+
+int rewind_init(struct rewind *rw, const size_t bytes)
+{
+	memset(rw, 0, sizeof(*rw));
+	rw->size   = MAX(bytes, (size_t)RECORD_MAX);
+	rw->buf	   = malloc(rw->size);
+	rw->state  = malloc(minigbs_state_size());
+	rw->record = malloc(RECORD_MAX);
+
+	if (rw->buf == NULL || rw->state == NULL || rw->record == NULL) {
+		rewind_free(rw);
+		return -1;
+	}
+
+	return 0;
+}
+
+void rewind_free(struct rewind *rw)
+{
+	free(rw->buf);
+	free(rw->state);
+	free(rw->record);
+	memset(rw, 0, sizeof(*rw));
+}
+
+void rewind_reset(struct rewind *rw)
+{
+	rw->start  = 0;
+	rw->used   = 0;
+	rw->count  = 0;
+	rw->primed = false;
+}
+
+void rewind_capture(struct minigbs *gbs, struct rewind *rw)
+{
+	const uint8_t *cur   = (const uint8_t *)gbs;
+	uint8_t *      rec   = rw->record + sizeof(uint32_t);
+	uint64_t       pages = gbs->ram_dirty;
+	uint32_t       len;
+
+	gbs->ram_dirty = 0;
+
+	if (!rw->primed) {
+		minigbs_save(gbs, rw->state);
+		rw->primed = true;
+		return;
+	}
+
+	memcpy(rec, &pages, sizeof(pages));
+	rec += sizeof(pages);
+	rec += region_diff(rec, cur, rw->state, CORE_WORDS);
+	rec += region_diff(rec, cur + AUDIO_OFFSET, rw->state + AUDIO_OFFSET,
+			   AUDIO_WORDS);
+
+	for (unsigned int p = 0; pages; p++, pages >>= 1) {
+		const size_t off = offsetof(struct minigbs, mem) +
+				   p * RAM_PAGE_SIZE;
+
+		if (pages & 1)
+			rec += region_diff(rec, cur + off, rw->state + off,
+					   PAGE_WORDS);
+	}
+
+	len = rec + sizeof(len) - rw->record;
+	memcpy(rw->record, &len, sizeof(len));
+	memcpy(rec, &len, sizeof(len));
+
+	/* Make room by dropping the oldest records. */
+	while (rw->used + len > rw->size) {
+		uint32_t old;
+
+		ring_get(rw, rw->start, (uint8_t *)&old, sizeof(old));
+		rw->start = (rw->start + old) % rw->size;
+		rw->used -= old;
+		rw->count--;
+	}
+
+	ring_put(rw, rw->record, len);
+	rw->count++;
+}
+
+unsigned int rewind_render(struct minigbs *gbs, struct rewind *rw, void *out,
+			   unsigned int frames)
+{
+	const size_t frame = audio_frame_size(&gbs->audio);
+	uint8_t *    dst   = out;
+	unsigned int calls = 0;
+
+	while (frames) {
+		unsigned int n = MIN(frames, gbs->audio.pending);
+
+		/* Render a single frame to start each block, which makes the
+		 * play call, after capturing the state before it. */
+		if (gbs->audio.pending == 0) {
+			rewind_capture(gbs, rw);
+			n = 1;
+		}
+
+		calls += minigbs_render(gbs, dst, n);
+		dst += n * frame;
+		frames -= n;
+	}
+
+	return calls;
+}
+
+/**
+ * Undo the newest record, turning the held state into the one before it.
+ */
+static void rewind_pop(struct rewind *rw)
+{
+	const size_t   end = rw->start + rw->used;
+	const uint8_t *rec = rw->record + sizeof(uint32_t);
+	uint64_t       pages;
+	uint32_t       len;
+
+	ring_get(rw, end - sizeof(len), (uint8_t *)&len, sizeof(len));
+	ring_get(rw, end - len, rw->record, len);
+
+	memcpy(&pages, rec, sizeof(pages));
+	rec += sizeof(pages);
+	rec += region_undo(rec, rw->state, CORE_WORDS);
+	rec += region_undo(rec, rw->state + AUDIO_OFFSET, AUDIO_WORDS);
+
+	for (unsigned int p = 0; pages; p++, pages >>= 1) {
+		const size_t off = offsetof(struct minigbs, mem) +
+				   p * RAM_PAGE_SIZE;
+
+		if (pages & 1)
+			rec += region_undo(rec, rw->state + off, PAGE_WORDS);
+	}
+
+	rw->used -= len;
+	rw->count--;
+}
+
+static uint64_t state_position(const struct rewind *rw)
+{
+	uint64_t position;
+
+	memcpy(&position, rw->state + offsetof(struct minigbs, position),
+	       sizeof(position));
+	return position;
+}
+
+uint64_t rewind_back(struct minigbs *gbs, struct rewind *rw,
+		     const uint64_t frames)
+{
+	uint64_t moved = 0;
+
+	if (!rw->primed)
+		return 0;
+
+	/* Songs restart at position 0, so only count steps going back. */
+	if (gbs->position >= state_position(rw))
+		moved = gbs->position - state_position(rw);
+
+	while (moved < frames && rw->count > 0) {
+		const uint64_t before = state_position(rw);
+
+		rewind_pop(rw);
+
+		if (before >= state_position(rw))
+			moved += before - state_position(rw);
+	}
+
+	minigbs_restore(gbs, rw->state);
+
+	/* Now identical to the held state, against which writes are
+	 * tracked. */
+	gbs->ram_dirty = 0;
+
+	return moved;
+}
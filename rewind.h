@@ -0,0 +1,73 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/**
+ * History of the state of one instance at every play call, allowing playback
+ * to step back through it.
+ *
+ * Only the newest state is held in full. Each older one is a record of the
+ * words that differed from the state after it, stored as the XOR of both, so
+ * that applying a record to a state turns it into the previous one. Of RAM,
+ * only the pages written since the last capture are compared. Records are
+ * kept in a fixed size ring, dropping the oldest when it is full.
+ */
+struct rewind {
+	uint8_t *buf;
+	size_t	 size;
+	size_t	 start;
+	size_t	 used;
+	unsigned int count;
+
+	/* State at the last capture, in minigbs_save() format. */
+	uint8_t *state;
+	bool	 primed;
+
+	/* Record being built or applied, which may wrap around the ring. */
+	uint8_t *record;
+};
+
+/**
+ * Prepare "rw" to hold "bytes" bytes of history.
+ * \return	0 on success, or -1 if memory could not be allocated.
+ */
+int rewind_init(struct rewind *rw, size_t bytes);
+
+/**
+ * Free all memory held by "rw".
+ */
+void rewind_free(struct rewind *rw);
+
+/**
+ * Drop all history, for example after another file is loaded.
+ */
+void rewind_reset(struct rewind *rw);
+
+/**
+ * Record the state of "gbs", which must not be inside a block, that is have
+ * no samples pending.
+ */
+void rewind_capture(struct minigbs *gbs, struct rewind *rw);
+
+/**
+ * Same as minigbs_render(), but captures the state into "rw" before every
+ * play call.
+ * \return	Number of play routine calls made.
+ */
+unsigned int rewind_render(struct minigbs *gbs, struct rewind *rw, void *out,
+			   unsigned int frames);
+
+/**
+ * Move playback back to the latest captured state at least "frames" frames
+ * before the current position, or to the oldest one held. Channels muted in
+ * "gbs" stay muted.
+ * \return	Number of frames moved back by.
+ */
+uint64_t rewind_back(struct minigbs *gbs, struct rewind *rw, uint64_t frames);
+
+#endif
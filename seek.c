@@ -0,0 +1,224 @@
+#include "seek.h"
+#include "util.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Frames rendered at a time while seeking; large enough for any format. */
+#define SEEK_FRAMES	4096
+
+void seek_index_init(struct seek_index *idx, const unsigned int song,
+		     const float seconds)
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->song	= song;
+	idx->interval	= MAX((unsigned int)(seconds * AUDIO_SAMPLE_RATE), 1U);
+	idx->state_size = minigbs_state_size();
+}
+
+void seek_index_free(struct seek_index *idx)
+{
+	free(idx->states);
+	idx->states = NULL;
+	idx->count  = 0;
+	idx->alloc  = 0;
+}
+
+/**
+ * Record a snapshot of "gbs" as the next one of "idx".
+ * \return	0 on success, or -1 if memory could not be allocated.
+ */
+static int seek_record(const struct minigbs *gbs, struct seek_index *idx)
+{
+	if (idx->count == idx->alloc) {
+		const unsigned int alloc = idx->alloc ? idx->alloc * 2 : 16;
+		uint8_t *	   states;
+
+		states = realloc(idx->states, alloc * idx->state_size);
+		if (states == NULL)
+			return -1;
+
+		idx->states = states;
+		idx->alloc  = alloc;
+	}
+
+	minigbs_save(gbs, idx->states + idx->count * idx->state_size);
+	idx->count++;
+	return 0;
+}
+
+int seek_next(const struct minigbs *gbs, struct seek_index *idx,
+	      const unsigned int frames)
+{
+	uint64_t next = (uint64_t)idx->count * idx->interval;
+
+	if (gbs->position == next) {
+		if (seek_record(gbs, idx) != 0)
+			return -1;
+
+		next += idx->interval;
+	}
+
+	/* Playback already past the next snapshot without having recorded it
+	 * never records again, and may render on. */
+	if (gbs->position > next)
+		return frames;
+
+	return MIN((uint64_t)frames, next - gbs->position);
+}
+
+int seek_render(struct minigbs *gbs, struct seek_index *idx, void *out,
+		unsigned int frames)
+{
+	const size_t frame = audio_frame_size(&gbs->audio);
+	uint8_t *    dst   = out;
+	int	     calls = 0;
+
+	while (frames) {
+		const int n = seek_next(gbs, idx, frames);
+
+		if (n < 0)
+			return -1;
+
+		calls += minigbs_render(gbs, dst, n);
+		dst += n * frame;
+		frames -= n;
+	}
+
+	if (seek_next(gbs, idx, 0) < 0)
+		return -1;
+
+	return calls;
+}
+
+int seek_to(struct minigbs *gbs, struct seek_index *idx, const uint64_t frame)
+{
+	uint8_t scratch[SEEK_FRAMES * 2 * sizeof(float)];
+
+	if (idx->count > 0) {
+		const uint64_t nearest = MIN(frame / idx->interval,
+					     (uint64_t)idx->count - 1);
+
+		minigbs_restore(gbs, idx->states + nearest * idx->state_size);
+	} else if (minigbs_song(gbs, idx->song) != MINIGBS_OK) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (gbs->position < frame) {
+		const unsigned int n = MIN(frame - gbs->position,
+					   (uint64_t)SEEK_FRAMES);
+
+		if (seek_render(gbs, idx, scratch, n) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Whether the saved state "state" has the same output format as "gbs".
+ */
+static bool seek_same_output(const struct minigbs *gbs, const uint8_t *state)
+{
+	const size_t	  base = offsetof(struct minigbs, audio);
+	enum audio_format fmt;
+	unsigned int	  channels;
+	bool		  dither;
+
+	memcpy(&fmt, state + base + offsetof(struct audio, out_format),
+	       sizeof(fmt));
+	memcpy(&channels, state + base + offsetof(struct audio, out_channels),
+	       sizeof(channels));
+	memcpy(&dither, state + base + offsetof(struct audio, out_dither),
+	       sizeof(dither));
+
+	return fmt == gbs->audio.out_format &&
+	       channels == gbs->audio.out_channels &&
+	       dither == gbs->audio.out_dither;
+}
+
+int seek_index_write(const struct seek_index *idx, const struct minigbs *gbs,
+		     const char *path)
+{
+	const struct minigbs_snapshot_header hdr = {
+		.magic = MINIGBS_SNAPSHOT_MAGIC,
+		.state_size = idx->state_size,
+		.count	    = idx->count,
+		.song	    = idx->song,
+		.interval   = idx->interval,
+		.gbs	    = gbs->h
+	};
+	FILE *f;
+	int   ret = 0;
+
+	if ((f = fopen(path, "wb")) == NULL)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(idx->states, idx->state_size, idx->count, f) != idx->count)
+		ret = -1;
+
+	if (fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+int seek_index_read(struct seek_index *idx, const struct minigbs *gbs,
+		    const char *path)
+{
+	struct minigbs_snapshot_header hdr;
+	uint8_t *		       states = NULL;
+	FILE *			       f;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto fail;
+	}
+
+	if (minigbs_snapshot_check(gbs, &hdr) != 0)
+		goto fail;
+
+	if (hdr.song != idx->song || hdr.interval == 0 || hdr.count == 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if ((states = malloc((size_t)hdr.count * hdr.state_size)) == NULL)
+		goto fail;
+
+	if (fread(states, hdr.state_size, hdr.count, f) != hdr.count) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto fail;
+	}
+
+	/* Pending samples are stored converted, so the output format of the
+	 * snapshots has to match. */
+	if (!seek_same_output(gbs, states)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	fclose(f);
+
+	free(idx->states);
+	idx->states   = states;
+	idx->count    = hdr.count;
+	idx->alloc    = hdr.count;
+	idx->interval = hdr.interval;
+	return 0;
+
+fail:
+	free(states);
+	fclose(f);
+	return -1;
+}
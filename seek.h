@@ -0,0 +1,79 @@
+#ifndef SEEK_H
+#define SEEK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/**
+ * Snapshots of one song taken every "interval" frames, from the start of the
+ * song onwards, allowing seeks to resume from the nearest one. Snapshots are
+ * taken while seeking, and while rendering or playing the song in order.
+ */
+struct seek_index {
+	unsigned int song;
+	unsigned int interval;
+	unsigned int count;
+	unsigned int alloc;
+	size_t	     state_size;
+	uint8_t *    states;
+};
+
+/**
+ * Prepare an empty index of song "song" with a snapshot every "seconds".
+ */
+void seek_index_init(struct seek_index *idx, unsigned int song,
+		     float seconds);
+
+/**
+ * Free the snapshots held by "idx".
+ */
+void seek_index_free(struct seek_index *idx);
+
+/**
+ * Record a snapshot of "gbs" into "idx" if playback is exactly where the next
+ * one missing from "idx" is due, for renderers that take snapshots between
+ * chunks of their own. The current song of "gbs" must be the song of "idx".
+ * \return	How many of the next "frames" frames can be rendered before
+ *		another snapshot is due, or -1 with errno set if the snapshot
+ *		could not be stored.
+ */
+int seek_next(const struct minigbs *gbs, struct seek_index *idx,
+	      unsigned int frames);
+
+/**
+ * Same as minigbs_render(), but also records a snapshot into "idx" whenever
+ * playback crosses an interval that has none yet. The current song of "gbs"
+ * must be the song of "idx".
+ * \return	Number of play routine calls made, or -1 with errno set if a
+ *		snapshot could not be stored.
+ */
+int seek_render(struct minigbs *gbs, struct seek_index *idx, void *out,
+		unsigned int frames);
+
+/**
+ * Move playback of the song of "idx" to frame "frame", by restoring the
+ * nearest snapshot at or before it and rendering only the remainder. Further
+ * snapshots are recorded on the way. Selects the song first, if needed.
+ * \return	0 on success, or -1 with errno set.
+ */
+int seek_to(struct minigbs *gbs, struct seek_index *idx, uint64_t frame);
+
+/**
+ * Write all snapshots of "idx" to the file "path".
+ * \return	0 on success, or -1 with errno set.
+ */
+int seek_index_write(const struct seek_index *idx, const struct minigbs *gbs,
+		     const char *path);
+
+/**
+ * Replace the snapshots of "idx" with those of the file "path", which must
+ * have been written for the same song of the GBS file loaded in "gbs".
+ * \return	0 on success, or -1 with errno set; EINVAL if the file does not
+ *		match.
+ */
+int seek_index_read(struct seek_index *idx, const struct minigbs *gbs,
+		    const char *path);
+
+#endif
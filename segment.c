@@ -0,0 +1,333 @@
+#include "segment.h"
+#include "wav.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Segments are between one and ten seconds long, aiming for four per thread
+ * so that threads finishing early pick up more. */
+#define SEGMENT_MIN_FRAMES	((unsigned int)AUDIO_SAMPLE_RATE)
+#define SEGMENT_MAX_FRAMES	((unsigned int)AUDIO_SAMPLE_RATE * 10)
+#define SEGMENT_PER_THREAD	4
+
+/* Frames rendered ahead of each segment. The high-pass filter keeps 0.996 of
+ * its state per frame, so after these the filters of channels playing in
+ * them usually match a serial render exactly. */
+#define SEGMENT_PREROLL		4800
+
+/* Frames between the states of a segment compared with a serial render
+ * continuing from the end of the previous one. */
+#define SEGMENT_CHECK_FRAMES	((unsigned int)AUDIO_SAMPLE_RATE)
+
+/* Segments buffered per thread, in case earlier ones are slower. */
+#define SEGMENT_WINDOW		2
+
+struct segment_render {
+	pthread_mutex_t	      lock;
+	pthread_cond_t	      cond;
+	const struct minigbs *gbs;
+	bool		      muted[4];
+
+	/* Snapshots to start each segment from, with the segment at its
+	 * index in the ring of output buffers once rendered, along with the
+	 * states every SEGMENT_CHECK_FRAMES into it and at its end. */
+	uint8_t *    states;
+	size_t	     state_size;
+	uint8_t **   bufs;
+	uint8_t **   checks;
+	unsigned int nchecks;
+	bool *	     done;
+	unsigned int window;
+
+	unsigned int frames;
+	unsigned int seg_frames;
+	unsigned int nsegs;
+
+	/* Next segment to start and to write to the file. */
+	unsigned int next;
+	unsigned int written;
+
+	/* errno of the first failure, which stops all threads. */
+	int error;
+};
+
+static void *segment_worker(void *arg)
+{
+	struct segment_render *s = arg;
+	struct minigbs *       gbs;
+	size_t		       frame;
+
+	if ((gbs = minigbs_clone(s->gbs)) == NULL) {
+		pthread_mutex_lock(&s->lock);
+		s->error = ENOMEM;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+
+	frame = audio_frame_size(&gbs->audio);
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		unsigned int i, k, n, done;
+		uint8_t *    buf;
+		uint8_t *    check;
+
+		/* Stay within the buffers not yet written out. */
+		while (s->next < s->nsegs && s->error == 0 &&
+		       s->next >= s->written + s->window)
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		if (s->next >= s->nsegs || s->error != 0)
+			break;
+
+		i     = s->next++;
+		buf   = s->bufs[i % s->window];
+		check = s->checks[i % s->window];
+		n     = MIN(s->seg_frames, s->frames - i * s->seg_frames);
+		pthread_mutex_unlock(&s->lock);
+
+		minigbs_restore(gbs, s->states + i * s->state_size);
+		for (unsigned int c = 0; c < 4; ++c)
+			audio_mute(&gbs->audio, c, s->muted[c]);
+
+		if (i > 0)
+			minigbs_render(gbs, buf, SEGMENT_PREROLL);
+
+		for (k = 0, done = 0; done < n;
+		     ++k, done += SEGMENT_CHECK_FRAMES) {
+			minigbs_save(gbs, check + k * s->state_size);
+			minigbs_render(gbs, buf + done * frame,
+				       MIN(SEGMENT_CHECK_FRAMES, n - done));
+		}
+		minigbs_save(gbs, check + k * s->state_size);
+
+		pthread_mutex_lock(&s->lock);
+		s->done[i % s->window] = true;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	minigbs_destroy(gbs);
+	return NULL;
+}
+
+/**
+ * Run a copy of "s->gbs" with every channel muted, so that synthesis is
+ * skipped, and store a snapshot SEGMENT_PREROLL frames before the start of
+ * each segment after the first. "scratch" holds "scratch_frames" frames.
+ * \return	0 on success, or -1 if memory could not be allocated.
+ */
+static int segment_scout(struct segment_render *s, uint8_t *scratch,
+			 const unsigned int scratch_frames)
+{
+	struct minigbs *gbs;
+	uint64_t	done = 0;
+
+	if ((gbs = minigbs_clone(s->gbs)) == NULL)
+		return -1;
+
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&gbs->audio, c, true);
+
+	minigbs_save(s->gbs, s->states);
+
+	for (unsigned int i = 1; i < s->nsegs; ++i) {
+		const uint64_t at =
+			(uint64_t)i * s->seg_frames - SEGMENT_PREROLL;
+
+		while (done < at) {
+			const unsigned int n = MIN(at - done,
+						   (uint64_t)scratch_frames);
+
+			minigbs_render(gbs, scratch, n);
+			done += n;
+		}
+
+		minigbs_save(gbs, s->states + i * s->state_size);
+	}
+
+	minigbs_destroy(gbs);
+	return 0;
+}
+
+/**
+ * Make the "n" frames of a segment in "buf" match a serial render, given the
+ * state "exact" a serial render has at its start and the states "check" of
+ * the segment, and leave "exact" at the state at its end. The play routine
+ * runs the same with synthesis skipped, so only audio state can differ, when
+ * the first pass left the filter of a channel at another level than
+ * rendering would and the pre-roll did not settle it. From the first state
+ * that differs, the segment is rendered again with "gbs" until it meets the
+ * states of the segment.
+ */
+static void segment_verify(const struct segment_render *s,
+			   struct minigbs *gbs, const uint8_t *check,
+			   uint8_t *buf, const unsigned int n, uint8_t *exact)
+{
+	const size_t audio = offsetof(struct minigbs, audio);
+	const size_t frame = audio_frame_size(&gbs->audio);
+	const size_t end   = (n + SEGMENT_CHECK_FRAMES - 1) /
+			   SEGMENT_CHECK_FRAMES * s->state_size;
+	bool	     fixing = false;
+
+	for (unsigned int k = 0, done = 0; done < n;
+	     ++k, done += SEGMENT_CHECK_FRAMES) {
+		if (memcmp(exact + audio, check + k * s->state_size + audio,
+			   sizeof(struct audio)) == 0) {
+			memcpy(exact, check + end, s->state_size);
+			return;
+		}
+
+		if (!fixing) {
+			minigbs_restore(gbs, exact);
+			for (unsigned int c = 0; c < 4; ++c)
+				audio_mute(&gbs->audio, c, s->muted[c]);
+			fixing = true;
+		}
+
+		minigbs_render(gbs, buf + done * frame,
+			       MIN(SEGMENT_CHECK_FRAMES, n - done));
+		minigbs_save(gbs, exact);
+	}
+}
+
+int render_segmented(const struct minigbs *gbs, const char *path,
+		     const float seconds, const enum audio_format fmt,
+		     const unsigned int channels, unsigned int threads)
+{
+	struct segment_render s = { .gbs = gbs };
+	const size_t	      frame = audio_frame_size(&gbs->audio);
+	pthread_t *	      tids  = NULL;
+	struct minigbs *      fix   = NULL;
+	uint8_t *	      exact = NULL;
+	unsigned int	      started = 0;
+	struct wav	      out;
+	int		      ret = -1;
+
+	threads	     = MAX(threads, 1U);
+	s.frames     = seconds * AUDIO_SAMPLE_RATE;
+	s.seg_frames = MIN(MAX(s.frames / (threads * SEGMENT_PER_THREAD),
+			       SEGMENT_MIN_FRAMES),
+			   SEGMENT_MAX_FRAMES);
+	s.nsegs	     = (s.frames + s.seg_frames - 1) / s.seg_frames;
+	s.window     = threads * SEGMENT_WINDOW;
+	s.state_size = minigbs_state_size();
+	s.nchecks    = (s.seg_frames + SEGMENT_CHECK_FRAMES - 1) /
+		    SEGMENT_CHECK_FRAMES;
+
+	for (unsigned int c = 0; c < 4; ++c)
+		s.muted[c] = audio_muted(&gbs->audio, c);
+
+	s.states = malloc(MAX(s.nsegs, 1U) * s.state_size);
+	s.bufs	 = calloc(s.window, sizeof(*s.bufs));
+	s.checks = calloc(s.window, sizeof(*s.checks));
+	s.done	 = calloc(s.window, sizeof(*s.done));
+	tids	 = calloc(threads, sizeof(*tids));
+	exact	 = malloc(s.state_size);
+	fix	 = minigbs_clone(gbs);
+	if (s.states == NULL || s.bufs == NULL || s.checks == NULL ||
+	    s.done == NULL || tids == NULL || exact == NULL || fix == NULL)
+		goto free;
+
+	for (unsigned int i = 0; i < s.window; ++i) {
+		if ((s.bufs[i] = malloc(s.seg_frames * frame)) == NULL ||
+		    (s.checks[i] = malloc((s.nchecks + 1) * s.state_size)) ==
+			    NULL)
+			goto free;
+	}
+
+	if (segment_scout(&s, s.bufs[0], s.seg_frames) != 0)
+		goto free;
+
+	memcpy(exact, s.states, s.state_size);
+
+	if (wav_open(&out, path, channels, AUDIO_SAMPLE_RATE,
+		     fmt == AUDIO_FORMAT_S16 ? 16 : 32) != 0)
+		goto free;
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+
+	for (started = 0; started < MIN(threads, MAX(s.nsegs, 1U));
+	     ++started) {
+		int err = pthread_create(&tids[started], NULL, segment_worker,
+					 &s);
+
+		if (err != 0) {
+			if (started == 0)
+				s.error = err;
+			break;
+		}
+	}
+
+	/* Write segments in order as the threads finish them, each once it
+	 * is known to continue from the end of the previous one. */
+	for (unsigned int i = 0; i < s.nsegs; ++i) {
+		const unsigned int slot = i % s.window;
+		const unsigned int n	= MIN(s.seg_frames,
+					      s.frames - i * s.seg_frames);
+		int		   err;
+
+		pthread_mutex_lock(&s.lock);
+		while (!s.done[slot] && s.error == 0)
+			pthread_cond_wait(&s.cond, &s.lock);
+		err = s.error;
+		pthread_mutex_unlock(&s.lock);
+
+		if (err == 0)
+			segment_verify(&s, fix, s.checks[slot], s.bufs[slot],
+				       n, exact);
+
+		if (err == 0 &&
+		    wav_write(&out, s.bufs[slot], n * frame) != 0)
+			err = errno;
+
+		pthread_mutex_lock(&s.lock);
+		if (err != 0) {
+			s.error = err;
+			pthread_cond_broadcast(&s.cond);
+			pthread_mutex_unlock(&s.lock);
+			break;
+		}
+		s.done[slot] = false;
+		s.written++;
+		pthread_cond_broadcast(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+	}
+
+	for (unsigned int i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+
+	ret = s.error == 0 ? 0 : -1;
+	if (wav_close(&out) != 0)
+		ret = -1;
+
+free:
+	for (unsigned int i = 0; i < s.window; ++i) {
+		if (s.bufs != NULL)
+			free(s.bufs[i]);
+		if (s.checks != NULL)
+			free(s.checks[i]);
+	}
+
+	free(s.bufs);
+	free(s.checks);
+	free(s.done);
+	free(s.states);
+	free(tids);
+	free(exact);
+	minigbs_destroy(fix);
+
+	if (s.error != 0)
+		errno = s.error;
+	return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "minigbs.h"
+
+/**
+ * Same as render_wav() without stems, but splits the song into segments that
+ * are rendered on "threads" threads at once.
+ *
+ * A first pass runs the play routine only, with synthesis skipped, to take a
+ * snapshot shortly before the start of each segment. Each segment then
+ * resumes from its snapshot and renders the frames before its start without
+ * writing them, so that the high-pass filters settle to the level they have
+ * at the end of the previous segment. Before a segment is written, its state
+ * every second is checked against a serial render continuing from the end of
+ * the previous segment, which takes over from the first state that differs,
+ * so that the output is identical to a serial render. "gbs" itself is not
+ * advanced.
+ * \return	0 on success, or -1 with errno set.
+ */
+int render_segmented(const struct minigbs *gbs, const char *path,
+		     float seconds, enum audio_format fmt,
+		     unsigned int channels, unsigned int threads);
+
+#endif
@@ -0,0 +1,416 @@
+#include "shard.h"
+#include "util.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Attempts at a job before it is given up on as crashing its worker. */
+#define SHARD_MAX_ATTEMPTS	2
+
+/* Shards handed to each worker over the whole run, when none crash. */
+#define SHARD_PER_WORKER	8
+
+/* Seconds a job may take to render, on top of one per second of output,
+ * before its worker is taken to be stuck and is killed. */
+#define SHARD_TIMEOUT_BASE	30.0
+
+/* Sent by the coordinator: render jobs "first" to "first + count - 1". */
+struct shard_msg {
+	uint32_t first;
+	uint32_t count;
+};
+
+/* Sent by a worker for each job of its shard, in order. */
+struct shard_result {
+	uint32_t job;
+	int32_t	 status;
+	double	 elapsed;
+};
+
+enum shard_status {
+	SHARD_PENDING,
+	SHARD_OK,
+	SHARD_FAILED,
+	SHARD_CRASHED
+};
+
+struct shard_job {
+	enum shard_status status;
+	unsigned int	  attempts;
+	double		  elapsed;
+};
+
+struct shard_worker {
+	pid_t	     pid;
+	int	     fd;
+	bool	     busy;
+	unsigned int first, count, done;
+
+	/* When the job being rendered times out, on the shard_now() clock. */
+	double deadline;
+};
+
+struct shard_state {
+	const struct render_job * jobs;
+	const struct render_opts *opts;
+	unsigned int		  njobs;
+
+	struct shard_job *   status;
+	struct shard_worker *workers;
+	unsigned int	     nworkers;
+
+	/* Next job never handed out, and jobs to retry on their own. */
+	unsigned int  next;
+	unsigned int *retry;
+	unsigned int  nretry;
+
+	unsigned int shard_size;
+	unsigned int remaining;
+};
+
+static double shard_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Start the timeout of the next job of the shard of busy worker "w".
+ */
+static void shard_start_job(const struct shard_state *s,
+			    struct shard_worker *w)
+{
+	const struct render_job *job = &s->jobs[w->first + w->done];
+
+	w->deadline = shard_now() + SHARD_TIMEOUT_BASE + job->seconds;
+}
+
+/**
+ * Body of a worker process: render each shard received on "fd" and send back
+ * a result for each of its jobs, until the coordinator closes the socket.
+ */
+static void __attribute__((noreturn))
+shard_work(const struct shard_state *s, const int fd)
+{
+	struct minigbs * gbs;
+	struct shard_msg msg;
+
+	if ((gbs = minigbs_create()) == NULL) {
+		fprintf(stderr, "Error: malloc failure at %d.\n", __LINE__);
+		_exit(EXIT_FAILURE);
+	}
+
+	while (recv(fd, &msg, sizeof(msg), 0) == sizeof(msg)) {
+		for (uint32_t i = msg.first; i < msg.first + msg.count; ++i) {
+			struct shard_result res = { .job = i };
+			const double	    start = shard_now();
+
+			res.status  = render_job(gbs, &s->jobs[i], s->opts);
+			res.elapsed = shard_now() - start;
+
+			if (send(fd, &res, sizeof(res), 0) != sizeof(res))
+				_exit(EXIT_FAILURE);
+		}
+	}
+
+	minigbs_destroy(gbs);
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start a worker process in slot "w".
+ * \return	0 on success, or -1 with errno set.
+ */
+static int shard_spawn(struct shard_state *s, struct shard_worker *w)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0)
+		return -1;
+
+	/* Keep buffered output from being written again by the child. */
+	fflush(NULL);
+
+	if ((w->pid = fork()) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (w->pid == 0) {
+		/* Only keep the socket to the coordinator. */
+		for (unsigned int i = 0; i < s->nworkers; ++i) {
+			if (s->workers[i].fd >= 0)
+				close(s->workers[i].fd);
+		}
+
+		close(sv[0]);
+		shard_work(s, sv[1]);
+	}
+
+	close(sv[1]);
+	w->fd	= sv[0];
+	w->busy = false;
+	return 0;
+}
+
+/**
+ * Reap worker "w" after its socket closed, or kill it once "timed_out" on a
+ * job. The job it was rendering counts as an attempt; it and the rest of the
+ * shard are queued to be retried alone.
+ */
+static void shard_lost(struct shard_state *s, struct shard_worker *w,
+		       const bool timed_out)
+{
+	int status = 0;
+
+	/* Also stops a worker that broke the protocol. */
+	close(w->fd);
+	w->fd = -1;
+	kill(w->pid, SIGKILL);
+	waitpid(w->pid, &status, 0);
+
+	if (w->busy && w->done < w->count) {
+		const unsigned int job = w->first + w->done;
+
+		if (timed_out)
+			fprintf(stderr, "Worker %d timed out while rendering "
+					"%s.\n",
+				(int)w->pid, s->jobs[job].out);
+		else if (WIFSIGNALED(status))
+			fprintf(stderr, "Worker %d killed by signal %d while "
+					"rendering %s.\n",
+				(int)w->pid, WTERMSIG(status),
+				s->jobs[job].out);
+		else
+			fprintf(stderr, "Worker %d exited while rendering "
+					"%s.\n",
+				(int)w->pid, s->jobs[job].out);
+
+		if (++s->status[job].attempts >= SHARD_MAX_ATTEMPTS) {
+			s->status[job].status = SHARD_CRASHED;
+			s->remaining--;
+		} else {
+			s->retry[s->nretry++] = job;
+		}
+
+		for (unsigned int i = job + 1; i < w->first + w->count; ++i)
+			s->retry[s->nretry++] = i;
+	}
+
+	w->busy = false;
+}
+
+/**
+ * Hand the next shard to idle worker "w", if any work is left.
+ */
+static void shard_dispatch(struct shard_state *s, struct shard_worker *w)
+{
+	struct shard_msg msg;
+
+	if (s->nretry > 0) {
+		msg.first = s->retry[--s->nretry];
+		msg.count = 1;
+	} else if (s->next < s->njobs) {
+		msg.first = s->next;
+		msg.count = MIN(s->shard_size, s->njobs - s->next);
+		s->next += msg.count;
+	} else {
+		return;
+	}
+
+	w->busy	 = true;
+	w->first = msg.first;
+	w->count = msg.count;
+	w->done	 = 0;
+	shard_start_job(s, w);
+
+	/* A worker that died since its last result is restarted later. */
+	if (send(w->fd, &msg, sizeof(msg), 0) != sizeof(msg))
+		shard_lost(s, w, false);
+}
+
+/**
+ * Read one result from worker "w".
+ * \return	false if the worker has gone away.
+ */
+static bool shard_receive(struct shard_state *s, struct shard_worker *w)
+{
+	struct shard_result res;
+
+	if (recv(w->fd, &res, sizeof(res), 0) != sizeof(res) || !w->busy ||
+	    res.job != w->first + w->done)
+		return false;
+
+	s->status[res.job].status  = res.status == 0 ? SHARD_OK : SHARD_FAILED;
+	s->status[res.job].elapsed = res.elapsed;
+	s->status[res.job].attempts++;
+	s->remaining--;
+
+	if (++w->done == w->count)
+		w->busy = false;
+	else
+		shard_start_job(s, w);
+
+	return true;
+}
+
+static void shard_report(const struct shard_state *s, FILE *report)
+{
+	static const char *const names[] = {
+		[SHARD_PENDING] = "pending",
+		[SHARD_OK]	= "ok",
+		[SHARD_FAILED]	= "failed",
+		[SHARD_CRASHED] = "crashed"
+	};
+
+	fprintf(report, "# status\tattempts\tseconds\trender_time\toutput\n");
+
+	for (unsigned int i = 0; i < s->njobs; ++i) {
+		const struct shard_job *j = &s->status[i];
+
+		fprintf(report, "%s\t%u\t%.3f\t%.3f\t%s\n", names[j->status],
+			j->attempts, s->jobs[i].seconds, j->elapsed,
+			s->jobs[i].out);
+	}
+}
+
+int render_sharded(const struct render_job *jobs, const unsigned int njobs,
+		   unsigned int procs, const struct render_opts *opts,
+		   FILE *report)
+{
+	struct shard_state s = {
+		.jobs = jobs, .opts = opts, .njobs = njobs, .remaining = njobs
+	};
+	struct pollfd *	   fds;
+	void (*old_pipe)(int);
+	unsigned int	   live	  = 0;
+	int		   failed = 0;
+
+	procs	     = MIN(MAX(procs, 1U), MAX(njobs, 1U));
+	s.nworkers   = procs;
+	s.shard_size = MAX(njobs / (procs * SHARD_PER_WORKER), 1U);
+
+	s.status  = calloc(MAX(njobs, 1U), sizeof(*s.status));
+	s.retry	  = calloc(MAX(njobs, 1U), sizeof(*s.retry));
+	s.workers = calloc(procs, sizeof(*s.workers));
+	fds	  = calloc(procs, sizeof(*fds));
+
+	if (s.status == NULL || s.retry == NULL || s.workers == NULL ||
+	    fds == NULL) {
+		failed = -1;
+		goto out;
+	}
+
+	/* Writes to dead workers are detected through their return value. */
+	old_pipe = signal(SIGPIPE, SIG_IGN);
+
+	for (unsigned int i = 0; i < procs; ++i)
+		s.workers[i].fd = -1;
+
+	for (unsigned int i = 0; i < procs; ++i) {
+		if (shard_spawn(&s, &s.workers[i]) == 0)
+			live++;
+	}
+
+	if (live == 0) {
+		failed = -1;
+		goto restore;
+	}
+
+	while (s.remaining > 0) {
+		bool   work_left = s.nretry > 0 || s.next < s.njobs;
+		double deadline	 = -1;
+		int    timeout	 = -1;
+
+		live = 0;
+		for (unsigned int i = 0; i < procs; ++i) {
+			struct shard_worker *w = &s.workers[i];
+
+			if (w->fd < 0 && work_left &&
+			    shard_spawn(&s, w) != 0)
+				perror("Error restarting worker");
+
+			if (w->fd >= 0 && !w->busy)
+				shard_dispatch(&s, w);
+
+			fds[i].fd     = w->fd;
+			fds[i].events = POLLIN;
+			live += w->fd >= 0;
+
+			if (w->busy && (deadline < 0 || w->deadline < deadline))
+				deadline = w->deadline;
+		}
+
+		/* Every worker died and none could be restarted. */
+		if (live == 0)
+			break;
+
+		/* Wake up for the first job to time out, rounding up. */
+		if (deadline >= 0)
+			timeout = MIN(MAX((deadline - shard_now()) * 1000 + 1,
+					  0.0), (double)INT_MAX);
+
+		if (poll(fds, procs, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for (unsigned int i = 0; i < procs; ++i) {
+			struct shard_worker *w = &s.workers[i];
+
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+
+			if (!(fds[i].revents & POLLIN) ||
+			    !shard_receive(&s, w))
+				shard_lost(&s, w, false);
+		}
+
+		/* A job stuck in its play routine never returns a result. */
+		for (unsigned int i = 0; i < procs; ++i) {
+			struct shard_worker *w = &s.workers[i];
+
+			if (w->fd >= 0 && w->busy && shard_now() >= w->deadline)
+				shard_lost(&s, w, true);
+		}
+	}
+
+	/* Closing the sockets tells the workers to exit. */
+	for (unsigned int i = 0; i < procs; ++i) {
+		struct shard_worker *w = &s.workers[i];
+
+		if (w->fd >= 0) {
+			close(w->fd);
+			waitpid(w->pid, NULL, 0);
+		}
+	}
+
+	for (unsigned int i = 0; i < njobs; ++i)
+		failed += s.status[i].status != SHARD_OK;
+
+	shard_report(&s, report);
+
+restore:
+	signal(SIGPIPE, old_pipe);
+out:
+	free(fds);
+	free(s.workers);
+	free(s.retry);
+	free(s.status);
+	return failed;
+}
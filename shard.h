@@ -0,0 +1,23 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+
+#include "render.h"
+
+/**
+ * Render all "njobs" jobs in "procs" worker processes. Jobs are split into
+ * shards of consecutive jobs, which are handed to idle workers over UNIX
+ * domain sockets. A worker that crashes, or takes longer than its length plus
+ * 30 seconds to render a job, is killed and restarted, and the jobs of its
+ * shard are retried one at a time; a job that crashes a worker twice is
+ * given up on. Once all jobs have finished, one line per job with its result
+ * and render time is written to "report".
+ * \return	Number of failed jobs, or -1 with errno set if no worker could
+ *		be started.
+ */
+int render_sharded(const struct render_job *jobs, unsigned int njobs,
+		   unsigned int procs, const struct render_opts *opts,
+		   FILE *report);
+
+#endif
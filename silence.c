@@ -0,0 +1,40 @@
+#include "silence.h"
+#include <stdbool.h>
+
+int silence_find(const struct minigbs *gbs, const uint64_t window,
+		 const uint64_t max_frames, uint64_t *end)
+{
+	struct minigbs *cpu;
+	uint64_t	frames;
+	bool		heard;
+	int		ret = 0;
+
+	if ((cpu = minigbs_clone(gbs)) == NULL)
+		return -1;
+
+	for (unsigned int c = 0; c < 4; ++c)
+		audio_mute(&cpu->audio, c, false);
+
+	/* The frames still pending belong to the last block rendered. */
+	frames = cpu->audio.pending;
+	heard  = frames > 0 && !audio_silent(&cpu->audio);
+
+	while (frames < max_frames) {
+		const struct audio *a = &cpu->audio;
+
+		process_cpu(cpu);
+		audio_update(&cpu->audio);
+		frames += a->block_frames;
+
+		if (!audio_silent(a)) {
+			heard = true;
+		} else if (heard && audio_silent_frames(a) >= window) {
+			*end = frames - audio_silent_frames(a);
+			ret  = 1;
+			break;
+		}
+	}
+
+	minigbs_destroy(cpu);
+	return ret;
+}
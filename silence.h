@@ -0,0 +1,22 @@
+#ifndef SILENCE_H
+#define SILENCE_H
+
+#include <stdint.h>
+
+#include "minigbs.h"
+
+/**
+ * Find where the song playing in "gbs" ends: the end of the last block with
+ * any output before a run of silent blocks lasting at least "window" frames,
+ * counted from where it was searched from in frames at AUDIO_SAMPLE_RATE.
+ * Silence before the first sound is not an end. The song runs on a copy of
+ * "gbs", which is not advanced, with every channel unmuted; silent channels
+ * are only fast-forwarded, so silence costs little more than the play calls.
+ * At most "max_frames" frames are searched.
+ * \return	1 if an end was found and stored in "*end", 0 if not, or -1 if
+ *		memory could not be allocated.
+ */
+int silence_find(const struct minigbs *gbs, uint64_t window,
+		 uint64_t max_frames, uint64_t *end);
+
+#endif
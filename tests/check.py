@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+# Assemble tests/check.gbs, the song rendered by "make check". Every eighth
+# play call starts a random note on a random channel, with random length,
+# envelope, sweep, duty and wave volume, so that channels keep starting and
+# stopping, and panning is swapped whenever NR52 reads back all channels off.
+# Song 0 is the default. Usage: check.py out.gbs
+import struct
+import sys
+
+LOAD=0x400
+code=[]; labels={}; fix=[]
+def L(n): labels[n]=LOAD+len(code)
+def b(*x): code.extend(x)
+def jr(op,n): b(op,0); fix.append((len(code)-1,n,'r'))
+def call(n): b(0xCD,0,0); fix.append((len(code)-2,n,'a'))
+def ldh_w(reg,val): b(0x3E,val,0xE0,reg)   # ld a,val ; ldh (reg),a
+def ldh_a(reg): b(0xE0,reg)                # ldh (reg),a
+SEED=0xC000; FRAME=0xC001
+# init: a = song index
+L('init')
+b(0x3C)                 # inc a
+b(0xEA,SEED&255,SEED>>8)    # ld (seed),a
+b(0xAF)                 # xor a
+b(0xEA,FRAME&255,FRAME>>8)  # ld (frame),a
+ldh_w(0x26,0x80)        # NR52 on
+ldh_w(0x25,0xFF)        # NR51
+ldh_w(0x24,0x77)        # NR50
+ldh_w(0x1A,0x00)        # NR30 off
+b(0x21,0x30,0xFF)       # ld hl,FF30
+b(0x0E,0x10)            # ld c,16
+L('wave')
+b(0x79)                 # ld a,c
+b(0xCB,0x37)            # swap a
+b(0xB1)                 # or c
+b(0x22)                 # ld (hl+),a
+b(0x0D)                 # dec c
+jr(0x20,'wave')
+b(0xC9)
+# rand: galois lfsr in seed -> a
+L('rand')
+b(0xFA,SEED&255,SEED>>8)
+b(0xCB,0x27)            # sla a
+jr(0x30,'rnc')
+b(0xEE,0x1D)
+L('rnc')
+b(0xEA,SEED&255,SEED>>8)
+b(0xC9)
+# play
+L('play')
+b(0x21,FRAME&255,FRAME>>8) # ld hl,frame
+b(0x34)                 # inc (hl)
+b(0x7E)                 # ld a,(hl)
+b(0xE6,0x07)            # and 7
+b(0xC0)                 # ret nz
+# once all channels are off, swap panning: depends on NR52 status readback
+b(0xF0,0x26)            # ldh a,(NR52)
+b(0xE6,0x0F)
+jr(0x20,'busy')
+b(0xF0,0x25); b(0x2F); b(0xE0,0x25)   # ldh a,(NR51); cpl; ldh (NR51),a
+L('busy')
+call('rand'); b(0x47)   # ld b,a
+call('rand'); b(0x4F)   # ld c,a
+b(0x78)                 # ld a,b
+b(0xE6,0x03)
+jr(0x28,'ch1')
+b(0x3D); jr(0x28,'ch2')
+b(0x3D); jr(0x28,'ch3')
+# ch4
+b(0x78,0xE6,0x3F); ldh_a(0x20)          # NR41 = b&3f
+b(0x79,0xE6,0xF7); ldh_a(0x21)          # NR42 = c&f7
+b(0x78,0xE6,0xDF); ldh_a(0x22)          # NR43 = b&df
+b(0x79,0xE6,0x40,0xF6,0x80); ldh_a(0x23)
+b(0xC9)
+L('ch1')
+b(0x79,0xE6,0x77); ldh_a(0x10)          # NR10 sweep = c&77
+b(0x78); ldh_a(0x11)                    # NR11 = b
+b(0x79,0xE6,0xF3); ldh_a(0x12)          # NR12 = c&f3
+b(0x78); ldh_a(0x13)                    # NR13 = b
+b(0x79,0xE6,0x47,0xF6,0x80); ldh_a(0x14)
+b(0xC9)
+L('ch2')
+b(0x79); ldh_a(0x16)
+b(0x78,0xE6,0xF5); ldh_a(0x17)
+b(0x79); ldh_a(0x18)
+b(0x78,0xE6,0x47,0xF6,0x80); ldh_a(0x19)
+b(0xC9)
+L('ch3')
+ldh_w(0x1A,0x80)
+b(0x79); ldh_a(0x1B)
+b(0x78,0xE6,0x60); ldh_a(0x1C)          # volume shift incl. 0
+b(0x79); ldh_a(0x1D)
+b(0x78,0xE6,0x47,0xF6,0x80); ldh_a(0x1E)
+b(0xC9)
+for pos,n,k in fix:
+    t=labels[n]
+    if k=='r':
+        off=t-(LOAD+pos+1); assert -128<=off<128; code[pos]=off&255
+    else:
+        code[pos]=t&255; code[pos+1]=t>>8
+def s32(x): return x.encode().ljust(32,b'\0')
+hdr=b'GBS'+bytes([1,3,1])+struct.pack('<HHHH',LOAD,labels['init'],labels['play'],0xFFFE)+bytes([0,0])+s32('MiniGBS check')+s32('MiniGBS')+s32('Public domain')
+assert len(hdr)==0x70
+open(sys.argv[1],'wb').write(hdr+bytes(code))
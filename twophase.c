@@ -0,0 +1,315 @@
+#include "twophase.h"
+#include "reglog.h"
+#include "wav.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest chunk of whole blocks synthesised at a time. */
+#define TWOPHASE_CHUNK_FRAMES	32768
+
+struct twophase;
+
+/**
+ * A thread synthesising one channel into two chunk buffers in turn.
+ */
+struct twophase_chan {
+	pthread_t	 thread;
+	struct audio *	 a;
+	float *		 bufs[2];
+	struct twophase *tp;
+};
+
+struct twophase {
+	const struct reglog *log;
+
+	/* First block of each chunk, followed by the number of blocks. */
+	size_t *     chunks;
+	unsigned int nchunks;
+
+	struct twophase_chan chans[4];
+
+	/* Threads wait for "ready" before using "barrier", which separates
+	 * chunks. With "stop" set, they do nothing more. */
+	pthread_mutex_t	  lock;
+	pthread_cond_t	  cond;
+	bool		  ready;
+	bool		  stop;
+	pthread_barrier_t barrier;
+};
+
+/**
+ * Replay the writes of each block of chunk "k" and synthesise the block.
+ */
+static void twophase_chunk(struct twophase_chan *c, const unsigned int k)
+{
+	const struct reglog *log = c->tp->log;
+	float *		     out = c->bufs[k % 2];
+
+	for (size_t b = c->tp->chunks[k]; b < c->tp->chunks[k + 1]; ++b) {
+		const size_t end = reglog_block_end(log, b);
+
+		for (size_t w = log->blocks[b].first; w < end; ++w)
+			audio_write(c->a, 0xFF00 + log->writes[w].reg,
+				    log->writes[w].val);
+
+		/* Replayed logs set block lengths, not the play rate. */
+		audio_set_block(c->a, log->blocks[b].frames);
+		audio_update(c->a);
+		memcpy(out, c->a->samples,
+		       c->a->block_frames * 2 * sizeof(float));
+		out += c->a->block_frames * 2;
+	}
+}
+
+static void *twophase_worker(void *arg)
+{
+	struct twophase_chan *c	 = arg;
+	struct twophase *     tp = c->tp;
+
+	pthread_mutex_lock(&tp->lock);
+	while (!tp->ready)
+		pthread_cond_wait(&tp->cond, &tp->lock);
+	pthread_mutex_unlock(&tp->lock);
+
+	if (__atomic_load_n(&tp->stop, __ATOMIC_RELAXED))
+		return NULL;
+
+	/* Chunk k is synthesised while the previous one is mixed. */
+	for (unsigned int k = 0; k <= tp->nchunks; ++k) {
+		if (k < tp->nchunks &&
+		    !__atomic_load_n(&tp->stop, __ATOMIC_RELAXED))
+			twophase_chunk(c, k);
+
+		pthread_barrier_wait(&tp->barrier);
+	}
+
+	return NULL;
+}
+
+/**
+ * Split the blocks of "tp->log" into chunks of at most TWOPHASE_CHUNK_FRAMES.
+ * \return	0 on success, or -1 if memory could not be allocated.
+ */
+static int twophase_split(struct twophase *tp)
+{
+	const struct reglog *log    = tp->log;
+	unsigned int	     frames = 0;
+
+	/* Blocks are never longer than a chunk, so each chunk holds at least
+	 * one. */
+	if ((tp->chunks = malloc((log->nblocks + 1) *
+				 sizeof(*tp->chunks))) == NULL)
+		return -1;
+
+	tp->nchunks = 0;
+	for (size_t b = 0; b < log->nblocks; ++b) {
+		if (b == 0 ||
+		    frames + log->blocks[b].frames > TWOPHASE_CHUNK_FRAMES) {
+			tp->chunks[tp->nchunks++] = b;
+			frames			  = 0;
+		}
+
+		frames += log->blocks[b].frames;
+	}
+
+	tp->chunks[tp->nchunks] = log->nblocks;
+	return 0;
+}
+
+/**
+ * Mix chunk "k" block by block in "mix" and write up to "*frames" frames of it
+ * to "out".
+ * \return	0 on success, or -1 with errno set.
+ */
+static int twophase_mix(const struct twophase *tp, struct audio *mix,
+			const unsigned int k, struct wav *out,
+			uint64_t *frames)
+{
+	const struct reglog *log = tp->log;
+	unsigned int	     off = 0;
+
+	for (size_t b = tp->chunks[k]; b < tp->chunks[k + 1] && *frames; ++b) {
+		const unsigned int n	= log->blocks[b].frames;
+		const unsigned int keep = MIN((uint64_t)n, *frames);
+		const float *	   chans[4];
+
+		for (unsigned int c = 0; c < 4; ++c)
+			chans[c] = tp->chans[c].bufs[k % 2] + off * 2;
+
+		audio_mix(mix, chans, n);
+
+		if (wav_write(out, mix->samples, keep * mix->frame_size) != 0)
+			return -1;
+
+		*frames -= keep;
+		mix->pending = 0;
+		off += n;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate a copy of "a" that synthesises only channel "chan" into stereo
+ * floating point samples, or any channel if "chan" is 4.
+ */
+static struct audio *twophase_audio(const struct audio *a,
+				    const unsigned int chan)
+{
+	struct audio *copy;
+
+	if ((copy = aligned_alloc(_Alignof(struct audio),
+				  sizeof(*copy))) == NULL)
+		return NULL;
+
+	memcpy(copy, a, sizeof(*copy));
+	copy->stems_enabled = false;
+	copy->stem_samples  = NULL;
+
+	if (chan < 4) {
+		audio_set_output(copy, AUDIO_FORMAT_F32, 2, false);
+
+		for (unsigned int c = 0; c < 4; ++c)
+			audio_mute(copy, c, c != chan || audio_muted(a, c));
+	}
+
+	return copy;
+}
+
+int render_two_phase(const struct minigbs *gbs, const char *path,
+		     const float seconds, const enum audio_format fmt,
+		     const unsigned int channels)
+{
+	struct twophase tp    = { .stop = false };
+	struct reglog	log;
+	struct minigbs *cpu;
+	struct audio *	mix = NULL;
+	struct wav	out;
+	uint64_t	frames = seconds * AUDIO_SAMPLE_RATE;
+	unsigned int	started = 0;
+	int		ret = -1;
+	int		err = 0;
+
+	reglog_init(&log);
+	tp.log = &log;
+
+	if ((cpu = minigbs_clone(gbs)) == NULL)
+		return -1;
+
+	if (wav_open(&out, path, channels, AUDIO_SAMPLE_RATE,
+		     fmt == AUDIO_FORMAT_S16 ? 16 : 32) != 0) {
+		minigbs_destroy(cpu);
+		return -1;
+	}
+
+	/* Finish the current block, so that the log starts with a play
+	 * call. */
+	if (cpu->audio.pending > 0) {
+		const unsigned int n = MIN((uint64_t)cpu->audio.pending,
+					   frames);
+		const size_t	   len = n * audio_frame_size(&cpu->audio);
+		uint8_t *	   buf;
+
+		if ((buf = malloc(len)) == NULL)
+			goto free;
+
+		minigbs_render(cpu, buf, n);
+		if (wav_write(&out, buf, len) != 0) {
+			free(buf);
+			goto free;
+		}
+
+		free(buf);
+		frames -= n;
+	}
+
+	/* The APU at the start of the log, for each channel and the mix. */
+	if ((mix = twophase_audio(&cpu->audio, 4)) == NULL)
+		goto free;
+
+	for (unsigned int c = 0; c < 4; ++c) {
+		struct twophase_chan *ch = &tp.chans[c];
+
+		ch->tp = &tp;
+		if ((ch->a = twophase_audio(&cpu->audio, c)) == NULL)
+			goto free;
+
+		for (unsigned int i = 0; i < 2; ++i) {
+			ch->bufs[i] = malloc(TWOPHASE_CHUNK_FRAMES * 2 *
+					     sizeof(float));
+			if (ch->bufs[i] == NULL)
+				goto free;
+		}
+	}
+
+	if (reglog_record(cpu, &log, frames) != 0 || twophase_split(&tp) != 0)
+		goto free;
+
+	pthread_mutex_init(&tp.lock, NULL);
+	pthread_cond_init(&tp.cond, NULL);
+
+	for (started = 0; started < 4; ++started) {
+		err = pthread_create(&tp.chans[started].thread, NULL,
+				     twophase_worker, &tp.chans[started]);
+		if (err != 0)
+			break;
+	}
+
+	if (started == 4)
+		pthread_barrier_init(&tp.barrier, NULL, 5);
+	else
+		tp.stop = true;
+
+	pthread_mutex_lock(&tp.lock);
+	tp.ready = true;
+	pthread_cond_broadcast(&tp.cond);
+	pthread_mutex_unlock(&tp.lock);
+
+	if (started == 4) {
+		for (unsigned int k = 0; k <= tp.nchunks; ++k) {
+			if (k > 0 && err == 0 &&
+			    twophase_mix(&tp, mix, k - 1, &out, &frames) != 0) {
+				err = errno;
+				__atomic_store_n(&tp.stop, true,
+						 __ATOMIC_RELAXED);
+			}
+
+			pthread_barrier_wait(&tp.barrier);
+		}
+	}
+
+	for (unsigned int c = 0; c < started; ++c)
+		pthread_join(tp.chans[c].thread, NULL);
+
+	if (started == 4)
+		pthread_barrier_destroy(&tp.barrier);
+
+	pthread_cond_destroy(&tp.cond);
+	pthread_mutex_destroy(&tp.lock);
+
+	ret = err == 0 ? 0 : -1;
+
+free:
+	if (wav_close(&out) != 0)
+		ret = -1;
+
+	for (unsigned int c = 0; c < 4; ++c) {
+		free(tp.chans[c].a);
+		free(tp.chans[c].bufs[0]);
+		free(tp.chans[c].bufs[1]);
+	}
+
+	free(mix);
+	free(tp.chunks);
+	reglog_free(&log);
+	minigbs_destroy(cpu);
+
+	if (err != 0)
+		errno = err;
+	return ret;
+}
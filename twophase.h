@@ -0,0 +1,22 @@
+#ifndef TWOPHASE_H
+#define TWOPHASE_H
+
+#include "minigbs.h"
+
+/**
+ * Same as render_wav() without stems, but in two phases. The first runs the
+ * play routine only, with synthesis skipped, and logs every audio register
+ * write it makes. The second replays the log into four copies of the APU,
+ * each synthesising a single channel on its own thread, while the calling
+ * thread mixes and writes the output of the previous chunk. Skipping
+ * synthesis leaves the channels in the state rendering would, so the play
+ * routine reads back the same channel status, and each channel is
+ * synthesised exactly as in a serial render: the output is bit-identical to
+ * it. "gbs" itself is not advanced.
+ * \return	0 on success, or -1 with errno set.
+ */
+int render_two_phase(const struct minigbs *gbs, const char *path,
+		     float seconds, enum audio_format fmt,
+		     unsigned int channels);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#define MIN(a, b) ({ (a) < (b) ? (a) : (b); })
+#define MAX(a, b) ({ (a) > (b) ? (a) : (b); })
+
+#endif
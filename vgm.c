@@ -0,0 +1,425 @@
+#include "vgm.h"
+#include "util.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VGM_VERSION		0x161
+#define VGM_SAMPLE_RATE		44100
+#define VGM_DMG_CLOCK		4194304
+
+/* Start of the commands in files without a data offset. */
+#define VGM_DATA_DEFAULT	0x40
+
+#define VGM_CMD_WAIT		0x61
+#define VGM_CMD_WAIT_735	0x62
+#define VGM_CMD_WAIT_882	0x63
+#define VGM_CMD_END		0x66
+#define VGM_CMD_WAIT_SHORT	0x70
+#define VGM_CMD_DATA_BLOCK	0x67
+
+/* Offsets in the header are relative to their own field. */
+#define VGM_REL(field)	offsetof(struct vgm_header, field)
+
+struct vgm_header {
+	char	 ident[4];
+	uint32_t eof_offset;
+	uint32_t version;
+	uint32_t sn76489_clock;
+	uint32_t ym2413_clock;
+	uint32_t gd3_offset;
+	uint32_t total_samples;
+	uint32_t loop_offset;
+	uint32_t loop_samples;
+	uint32_t rate;
+	uint8_t	 reserved0[0x34 - 0x28];
+	uint32_t data_offset;
+	uint8_t	 reserved1[0x80 - 0x38];
+	uint32_t dmg_clock;
+	uint8_t	 reserved2[0x100 - 0x84];
+} __attribute__((packed));
+
+static void *vgm_writer(void *arg)
+{
+	struct vgm *v = arg;
+
+	for (;;) {
+		unsigned int k;
+
+		sem_wait(&v->filled);
+
+		/* Woken without a chunk by vgm_close(), once all the chunks
+		 * before have been written. */
+		if (v->head == __atomic_load_n(&v->tail, __ATOMIC_ACQUIRE))
+			break;
+
+		/* Chunks are still taken after a failure, so that capture never
+		 * waits for a writer that has given up. */
+		k = v->head % VGM_CHUNKS;
+		if (v->err == 0 &&
+		    fwrite(v->chunks + k * VGM_CHUNK_SIZE, 1, v->lens[k],
+			   v->f) != v->lens[k])
+			v->err = errno;
+
+		v->head++;
+		sem_post(&v->empty);
+	}
+
+	return NULL;
+}
+
+/**
+ * Hand the chunk being filled to the writer thread.
+ */
+static void vgm_push(struct vgm *v)
+{
+	v->lens[v->tail % VGM_CHUNKS] = v->len;
+	__atomic_store_n(&v->tail, v->tail + 1, __ATOMIC_RELEASE);
+	sem_post(&v->filled);
+}
+
+void vgm_next(struct vgm *v)
+{
+	vgm_push(v);
+	sem_wait(&v->empty);
+	v->buf = v->chunks + (v->tail % VGM_CHUNKS) * VGM_CHUNK_SIZE;
+	v->len = 0;
+}
+
+struct vgm *vgm_open(const char *path, const struct audio *a)
+{
+	const struct vgm_header hdr = { .ident = "Vgm " };
+	struct vgm *		v;
+	int			err;
+
+	if ((v = calloc(1, sizeof(*v))) == NULL)
+		return NULL;
+
+	if ((v->chunks = malloc(VGM_CHUNKS * VGM_CHUNK_SIZE)) == NULL) {
+		free(v);
+		return NULL;
+	}
+
+	/* The header is filled in once the length is known. */
+	if ((v->f = fopen(path, "wb")) == NULL ||
+	    fwrite(&hdr, sizeof(hdr), 1, v->f) != 1) {
+		err = errno;
+		goto fail;
+	}
+
+	v->buf = v->chunks;
+	sem_init(&v->filled, 0, 0);
+	sem_init(&v->empty, 0, VGM_CHUNKS - 1);
+
+	if ((err = pthread_create(&v->thread, NULL, vgm_writer, v)) != 0) {
+		sem_destroy(&v->filled);
+		sem_destroy(&v->empty);
+		goto fail;
+	}
+
+	/* Registers are held from 0xFF06. Power first, as the other registers
+	 * ignore writes without it. */
+	vgm_write(v, 0xFF26, a->mem[0xFF26 - 0xFF06]);
+
+	for (uint16_t addr = 0xFF10; addr <= 0xFF3F; ++addr) {
+		uint8_t val = a->mem[addr - 0xFF06];
+
+		if (addr == 0xFF26 || (addr > 0xFF26 && addr < 0xFF30))
+			continue;
+
+		/* Restarting channels would restart their envelopes and
+		 * lengths too. */
+		if (addr == 0xFF14 || addr == 0xFF19 || addr == 0xFF1E ||
+		    addr == 0xFF23)
+			val &= ~0x80;
+
+		vgm_write(v, addr, val);
+	}
+
+	vgm_wait(v, a->pending);
+	return v;
+
+fail:
+	if (v->f != NULL) {
+		fclose(v->f);
+		remove(path);
+	}
+
+	free(v->chunks);
+	free(v);
+	errno = err;
+	return NULL;
+}
+
+void vgm_wait(struct vgm *v, const unsigned int frames)
+{
+	uint64_t samples;
+
+	/* Rounded from the total, so that error does not accumulate. */
+	v->frames += frames;
+	samples = v->frames * VGM_SAMPLE_RATE / AUDIO_SAMPLE_RATE - v->samples;
+	v->samples += samples;
+
+	while (samples > 0) {
+		const unsigned int n = MIN(samples, (uint64_t)UINT16_MAX);
+
+		if (v->len + VGM_COMMAND_MAX > VGM_CHUNK_SIZE)
+			vgm_next(v);
+
+		if (n <= 16) {
+			v->buf[v->len++] = VGM_CMD_WAIT_SHORT + n - 1;
+		} else if (n == 735) {
+			v->buf[v->len++] = VGM_CMD_WAIT_735;
+		} else if (n == 882) {
+			v->buf[v->len++] = VGM_CMD_WAIT_882;
+		} else {
+			v->buf[v->len++] = VGM_CMD_WAIT;
+			v->buf[v->len++] = n & 0xFF;
+			v->buf[v->len++] = n >> 8;
+		}
+
+		samples -= n;
+	}
+}
+
+int vgm_close(struct vgm *v)
+{
+	struct vgm_header hdr = {
+		.ident	       = "Vgm ",
+		.version       = VGM_VERSION,
+		.total_samples = v->samples,
+		.data_offset   = sizeof(hdr) - VGM_REL(data_offset),
+		.dmg_clock     = VGM_DMG_CLOCK,
+	};
+	uint64_t size = sizeof(hdr);
+	int	 err;
+
+	if (v->len + 1 > VGM_CHUNK_SIZE)
+		vgm_next(v);
+
+	v->buf[v->len++] = VGM_CMD_END;
+	vgm_push(v);
+
+	/* Wake the writer thread once more, without a chunk, to stop it. */
+	sem_post(&v->filled);
+	pthread_join(v->thread, NULL);
+
+	err = v->err;
+	if (err == 0) {
+		long end = ftell(v->f);
+
+		if (end < 0)
+			err = errno;
+		else
+			size = end;
+	}
+
+	hdr.eof_offset = size - VGM_REL(eof_offset);
+
+	if (err == 0 && (fseek(v->f, 0, SEEK_SET) != 0 ||
+			 fwrite(&hdr, sizeof(hdr), 1, v->f) != 1))
+		err = errno;
+
+	if (fclose(v->f) != 0 && err == 0)
+		err = errno;
+
+	sem_destroy(&v->filled);
+	sem_destroy(&v->empty);
+	free(v->chunks);
+	free(v);
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Length in bytes of command "cmd" other than a write to the DMG, a wait or a
+ * data block, or 0 if it is not known.
+ */
+static size_t vgm_cmd_len(const uint8_t cmd)
+{
+	switch (cmd) {
+	case 0x30 ... 0x3F:
+	case 0x4F:
+	case 0x50:
+		return 2;
+	case 0x40 ... 0x4E:
+	case 0x51 ... 0x5F:
+	case 0xA0 ... 0xBF:
+		return 3;
+	case 0x80 ... 0x8F:
+		return 1;
+	case 0x90:
+	case 0x91:
+	case 0x95:
+		return 5;
+	case 0x92:
+		return 6;
+	case 0x93:
+		return 11;
+	case 0x94:
+		return 2;
+	case 0xC0 ... 0xDF:
+		return 4;
+	case 0xE0 ... 0xFF:
+		return 5;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Read all of the file "path" into a new buffer.
+ * \return	Buffer, or NULL with errno set.
+ */
+static uint8_t *vgm_read(const char *path, size_t *size)
+{
+	uint8_t *data = NULL;
+	FILE *	 f;
+	long	 len;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return NULL;
+
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) != 0)
+		goto out;
+
+	if ((data = malloc(len + 1)) != NULL &&
+	    fread(data, 1, len, f) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+
+	*size = len;
+
+out:
+	fclose(f);
+	return data;
+}
+
+/**
+ * Parse the commands of "data" into "log".
+ * \return	false if a command is not known or runs past the end.
+ */
+static bool vgm_parse(struct reglog *log, const uint8_t *data,
+		      const size_t size, size_t pos)
+{
+	struct reglog_block *b	    = NULL;
+	uint64_t	     samples = 0;
+	uint64_t	     frames  = 0;
+
+	while (pos < size && data[pos] != VGM_CMD_END && !log->failed) {
+		const uint8_t cmd = data[pos];
+		uint64_t      target;
+		size_t	      len = 1;
+
+		if (cmd == VGM_CMD_DMG_WRITE) {
+			len = 3;
+			if (pos + len > size)
+				return false;
+
+			/* Writes start a block at the current time, unless it
+			 * has just started. Only the first DMG is played. */
+			if (b == NULL || b->frames > 0)
+				b = reglog_block(log);
+
+			if (data[pos + 1] < 0x30)
+				reglog_write(log, 0xFF10 + data[pos + 1],
+					     data[pos + 2]);
+		} else if (cmd == VGM_CMD_WAIT) {
+			len = 3;
+			if (pos + len > size)
+				return false;
+
+			samples += data[pos + 1] | data[pos + 2] << 8;
+		} else if (cmd == VGM_CMD_WAIT_735) {
+			samples += 735;
+		} else if (cmd == VGM_CMD_WAIT_882) {
+			samples += 882;
+		} else if ((cmd & 0xF0) == VGM_CMD_WAIT_SHORT) {
+			samples += (cmd & 0x0F) + 1;
+		} else if ((cmd & 0xF0) == 0x80) {
+			/* YM2612 sample output, then a short wait. */
+			samples += cmd & 0x0F;
+		} else if (cmd == VGM_CMD_DATA_BLOCK) {
+			uint32_t n;
+
+			if (pos + 7 > size)
+				return false;
+
+			memcpy(&n, data + pos + 3, sizeof(n));
+			len = 7 + (size_t)n;
+		} else if ((len = vgm_cmd_len(cmd)) == 0) {
+			return false;
+		}
+
+		/* Time before the first write has nothing to play. */
+		target = samples * AUDIO_SAMPLE_RATE / VGM_SAMPLE_RATE;
+		if (b == NULL)
+			frames = target;
+
+		while (frames < target) {
+			unsigned int n;
+
+			if (b->frames == AUDIO_MAX_FRAMES &&
+			    (b = reglog_block(log)) == NULL)
+				break;
+
+			n = MIN(target - frames,
+				(uint64_t)AUDIO_MAX_FRAMES - b->frames);
+			b->frames += n;
+			frames += n;
+		}
+
+		pos += len;
+	}
+
+	return pos <= size;
+}
+
+int vgm_load(struct reglog *log, const char *path)
+{
+	struct vgm_header hdr = { .version = 0 };
+	uint8_t *	  data;
+	size_t		  size;
+	size_t		  start;
+	int		  ret = -1;
+
+	if ((data = vgm_read(path, &size)) == NULL)
+		return -1;
+
+	/* Fields beyond the header of older versions read as 0. */
+	memcpy(&hdr, data, MIN(size, sizeof(hdr)));
+	if (size < VGM_DATA_DEFAULT ||
+	    memcmp(hdr.ident, "Vgm ", sizeof(hdr.ident)) != 0 ||
+	    hdr.version < VGM_VERSION || hdr.dmg_clock == 0) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	start = hdr.data_offset ? VGM_REL(data_offset) + hdr.data_offset :
+				  VGM_DATA_DEFAULT;
+	if (!vgm_parse(log, data, size, start)) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	if (log->failed) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (ret != 0)
+		reglog_free(log);
+
+	free(data);
+	return ret;
+}
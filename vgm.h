@@ -0,0 +1,116 @@
+#ifndef VGM_H
+#define VGM_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "audio.h"
+#include "reglog.h"
+
+/* Size of each chunk of commands handed to the writer thread, and number of
+ * chunks allocated up front. */
+#define VGM_CHUNK_SIZE		(64 * 1024)
+#define VGM_CHUNKS		8
+
+/* Longest command, which must always fit in the rest of a chunk. */
+#define VGM_COMMAND_MAX		3
+
+#define VGM_CMD_DMG_WRITE	0xB3
+
+/**
+ * VGM file being captured from an instance. Commands are encoded straight
+ * into chunks allocated when the file is opened; full chunks are written out
+ * by a thread of its own, so capturing never allocates or writes to the file.
+ * Only the thread running the instance may add commands.
+ */
+struct vgm {
+	/* Chunk being filled, and the number of bytes in it. */
+	uint8_t *buf;
+	size_t	 len;
+
+	/* Frames played since the file was opened, and the VGM samples of 1/44100
+	 * s waited for so far. */
+	uint64_t frames;
+	uint64_t samples;
+
+	/* Ring of chunks. The thread running the instance fills the one at
+	 * "tail" and advances it, and the writer thread advances "head".
+	 * "filled" counts full chunks, and "empty" free ones. */
+	uint8_t *    chunks;
+	size_t	     lens[VGM_CHUNKS];
+	unsigned int head;
+	unsigned int tail;
+	sem_t	     filled;
+	sem_t	     empty;
+
+	pthread_t thread;
+	FILE *	  f;
+
+	/* errno of the first failed write to the file, or 0. */
+	int err;
+};
+
+/**
+ * Create the VGM file "path" for the Game Boy DMG and start its writer thread.
+ * The file starts with the current audio registers of "a", with channels left
+ * untriggered, so that capture should normally start with a song. Writes are
+ * then timed from the frames still pending in "a".
+ * \return	File, or NULL with errno set.
+ */
+struct vgm *vgm_open(const char *path, const struct audio *a);
+
+/**
+ * Hand the chunk being filled to the writer thread and start the next,
+ * waiting for the writer thread if every chunk is full.
+ */
+void vgm_next(struct vgm *v);
+
+/**
+ * Add a write of "val" to the audio register at "addr", timed at the end of
+ * the frames played so far. Called for every write to an audio register by
+ * the instance the file is attached to; writes to timer registers, which are
+ * not part of the APU, are left out.
+ */
+static inline void vgm_write(struct vgm *v, const uint16_t addr,
+			     const uint8_t val)
+{
+	if (addr < 0xFF10)
+		return;
+
+	if (v->len + VGM_COMMAND_MAX > VGM_CHUNK_SIZE)
+		vgm_next(v);
+
+	v->buf[v->len++] = VGM_CMD_DMG_WRITE;
+	v->buf[v->len++] = addr - 0xFF10;
+	v->buf[v->len++] = val;
+}
+
+/**
+ * Advance the time of later writes by "frames" frames at AUDIO_SAMPLE_RATE.
+ * Called after each play call with the frames of its block.
+ */
+void vgm_wait(struct vgm *v, unsigned int frames);
+
+/**
+ * End the file, wait for the writer thread to write it all, fill in its
+ * header and close it. "v" is freed either way.
+ * \return	0 on success, or -1 with errno set.
+ */
+int vgm_close(struct vgm *v);
+
+/**
+ * Read the Game Boy DMG writes of the VGM file "path" into "log", which must
+ * be empty, for playing with minigbs_replay(). Each run of writes starts a
+ * block, which lasts until the next, split as needed to fit in audio blocks.
+ * Commands for other chips are skipped; loops and compressed files are not
+ * supported.
+ * \return	0 on success, or -1 with errno set; EINVAL if the file is not a
+ *		VGM file with a Game Boy DMG.
+ */
+int vgm_load(struct reglog *log, const char *path);
+
+#endif
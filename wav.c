@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wav.h"
+#include "util.h"
+
+#define WAV_FORMAT_PCM		1
+#define WAV_FORMAT_IEEE_FLOAT	3
+
+/* Offline rendering writes far faster than realtime, so buffer generously to
+ * keep the number of write calls low. */
+#define WAV_BUFFER_SIZE		(1024 * 1024)
+
+/* Bytes faded at a time. */
+#define WAV_FADE_CHUNK		(64 * 1024)
+
+struct wav_header {
+	char	 riff_id[4];
+	uint32_t riff_size;
+	char	 wave_id[4];
+	char	 fmt_id[4];
+	uint32_t fmt_size;
+	uint16_t format;
+	uint16_t channels;
+	uint32_t rate;
+	uint32_t byte_rate;
+	uint16_t block_align;
+	uint16_t bits;
+	char	 data_id[4];
+	uint32_t data_size;
+} __attribute__((packed));
+
+int wav_open(struct wav *w, const char *path, const unsigned int channels,
+	     const unsigned int rate, const unsigned int bits)
+{
+	const struct wav_header hdr = {
+		.riff_id     = "RIFF",
+		.riff_size   = sizeof(hdr) - 8,
+		.wave_id     = "WAVE",
+		.fmt_id	     = "fmt ",
+		.fmt_size    = 16,
+		.format	     = bits == 32 ? WAV_FORMAT_IEEE_FLOAT :
+					    WAV_FORMAT_PCM,
+		.channels    = channels,
+		.rate	     = rate,
+		.byte_rate   = rate * channels * (bits / 8),
+		.block_align = channels * (bits / 8),
+		.bits	     = bits,
+		.data_id     = "data",
+		.data_size   = 0,
+	};
+
+	w->data_size = 0;
+	w->f	     = fopen(path, "wb");
+
+	if (w->f == NULL)
+		return -1;
+
+	setvbuf(w->f, NULL, _IOFBF, WAV_BUFFER_SIZE);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+		fclose(w->f);
+		return -1;
+	}
+
+	return 0;
+}
+
+int wav_write(struct wav *w, const void *data, const size_t len)
+{
+	if (fwrite(data, 1, len, w->f) != len)
+		return -1;
+
+	w->data_size += len;
+	return 0;
+}
+
+int wav_close(struct wav *w)
+{
+	const uint32_t riff_size = sizeof(struct wav_header) - 8 + w->data_size;
+	int	       ret	 = 0;
+
+	/* Patch the chunk sizes now that the length of the data is known. */
+	if (fseek(w->f, offsetof(struct wav_header, riff_size), SEEK_SET) != 0 ||
+	    fwrite(&riff_size, sizeof(riff_size), 1, w->f) != 1 ||
+	    fseek(w->f, offsetof(struct wav_header, data_size), SEEK_SET) != 0 ||
+	    fwrite(&w->data_size, sizeof(w->data_size), 1, w->f) != 1)
+		ret = -1;
+
+	if (fclose(w->f) != 0)
+		ret = -1;
+
+	w->f = NULL;
+	return ret;
+}
+
+int wav_fade_out(const char *path, const uint32_t frames)
+{
+	struct wav_header hdr;
+	uint8_t		  buf[WAV_FADE_CHUNK];
+	uint32_t	  total, start, fade, done = 0;
+	long		  pos;
+	FILE *		  f;
+	int		  ret = -1;
+
+	if ((f = fopen(path, "r+b")) == NULL)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.block_align == 0 ||
+	    (hdr.bits != 16 && hdr.bits != 32)) {
+		if (!ferror(f))
+			errno = EINVAL;
+		goto out;
+	}
+
+	total = hdr.data_size / hdr.block_align;
+	fade  = frames < total ? frames : total;
+	start = total - fade;
+	pos   = sizeof(hdr) + (long)start * hdr.block_align;
+
+	/* Gain falls linearly from 1 to 0 over the faded frames. */
+	while (done < fade) {
+		const uint32_t n = MIN(fade - done,
+				       (uint32_t)(sizeof(buf) / hdr.block_align));
+		const size_t   len = (size_t)n * hdr.block_align;
+
+		if (fseek(f, pos, SEEK_SET) != 0 || fread(buf, len, 1, f) != 1) {
+			if (!ferror(f))
+				errno = EINVAL;
+			goto out;
+		}
+
+		for (uint32_t i = 0; i < n; ++i) {
+			const float gain = (float)(fade - done - i - 1) / fade;
+			uint8_t *   frame = buf + (size_t)i * hdr.block_align;
+
+			for (unsigned int c = 0; c < hdr.channels; ++c) {
+				if (hdr.bits == 32) {
+					float s;
+
+					memcpy(&s, frame + c * 4, sizeof(s));
+					s *= gain;
+					memcpy(frame + c * 4, &s, sizeof(s));
+				} else {
+					int16_t s;
+
+					memcpy(&s, frame + c * 2, sizeof(s));
+					s = lrintf(s * gain);
+					memcpy(frame + c * 2, &s, sizeof(s));
+				}
+			}
+		}
+
+		if (fseek(f, pos, SEEK_SET) != 0 || fwrite(buf, len, 1, f) != 1)
+			goto out;
+
+		pos += len;
+		done += n;
+	}
+
+	ret = 0;
+
+out:
+	if (fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct wav {
+	FILE *	 f;
+	uint32_t data_size;
+};
+
+/**
+ * Create the WAV file "path" and write a header for "channels" interleaved
+ * channels at "rate" Hz. With "bits" of 32, samples are IEEE floating point;
+ * otherwise they are signed integer PCM. Writes are fully buffered.
+ * \return	0 on success, or -1 with errno set.
+ */
+int wav_open(struct wav *w, const char *path, unsigned int channels,
+	     unsigned int rate, unsigned int bits);
+
+/**
+ * Append "len" bytes of interleaved samples in "data" to the file.
+ * \return	0 on success, or -1 with errno set.
+ */
+int wav_write(struct wav *w, const void *data, size_t len);
+
+/**
+ * Update the sizes recorded in the header and close the file.
+ * \return	0 on success, or -1 with errno set.
+ */
+int wav_close(struct wav *w);
+
+/**
+ * Fade the last "frames" frames of the closed WAV file "path", written with
+ * wav_open(), out to silence, or all of it if it is shorter.
+ * \return	0 on success, or -1 with errno set.
+ */
+int wav_fade_out(const char *path, uint32_t frames);
+
+#endif